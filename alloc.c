@@ -19,6 +19,10 @@
  * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <linux/rbtree_augmented.h>
+#include <linux/blkdev.h>
+#include <linux/sched.h>
+
 #include "ntfs_fn.h"
 
 /*
@@ -72,79 +76,374 @@ int ntfs_chk_sectors(struct super_block *s, secno start, int len, char *msg)
         return 0;
 }
 
+/*
+ * Count the free 4-sector aligned runs in the nibbles touched by bits
+ * start .. start+len-1 of a band bitmap. These are where dnodes go once
+ * the directory band is full.
+ */
+
+unsigned ntfs_count_free_quads(__le32 *bmp, unsigned start, unsigned len)
+{
+        unsigned end = (start + len + 3) & ~3;
+        unsigned n = 0;
+        start &= ~3;
+        while (start < end) {
+                unsigned bit = start & 0x1f;
+                unsigned k = min(32 - bit, end - start);
+                u32 x = le32_to_cpu(bmp[start >> 5]) >> bit;
+                if (k < 32) x &= (1U << k) - 1;
+                n += hweight32(x & x >> 1 & x >> 2 & x >> 3 & 0x11111111);
+                start += k;
+        }
+        return n;
+}
+
+/*
+ * Keep the free sector counts (per band and total) and the free quad count
+ * in sync with the main bitmaps. n is positive when sectors are freed,
+ * negative when allocated; quads is ntfs_count_free_quads() of the range
+ * before the bits were changed.
+ */
+
+static void account_free(struct super_block *s, __le32 *bmp, secno sec, int n, unsigned quads)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        if (sbi->sb_band_free) sbi->sb_band_free[sec >> 14] += n;
+        if (sbi->sb_n_free != -1) sbi->sb_n_free += n;
+        sbi->sb_n_free_quads += ntfs_count_free_quads(bmp, sec & 0x3fff, abs(n)) - quads;
+}
+
+/*
+ * In-memory index of free extents in the main bitmaps. Every extent lies
+ * within one band. The rbtree is keyed by start sector and each node also
+ * keeps the longest extent in its subtree, so the first extent of a given
+ * length after some sector is found without walking the whole tree.
+ * The index mirrors the bitmaps; the bitmaps are touched only to commit
+ * the final bit change. If we run out of memory while updating it, or it
+ * would hold more than FREE_TREE_MAX extents, the index is dropped and
+ * allocation falls back to scanning the bitmaps.
+ */
+
+struct free_extent {
+        struct rb_node rb;
+        secno start;
+        unsigned len;
+        unsigned max_len;       /* longest extent in this subtree */
+};
+
+static inline unsigned free_extent_max(struct free_extent *e)
+{
+        unsigned max = e->len;
+        struct free_extent *c;
+        if (e->rb.rb_left) {
+                c = rb_entry(e->rb.rb_left, struct free_extent, rb);
+                if (c->max_len > max) max = c->max_len;
+        }
+        if (e->rb.rb_right) {
+                c = rb_entry(e->rb.rb_right, struct free_extent, rb);
+                if (c->max_len > max) max = c->max_len;
+        }
+        return max;
+}
+
+RB_DECLARE_CALLBACKS(static, free_extent_cb, struct free_extent, rb,
+                     unsigned, max_len, free_extent_max)
+
+static int free_tree_insert(struct ntfs_sb_info *sbi, secno start, unsigned len)
+{
+        struct rb_node **p = &sbi->sb_free_tree.rb_node, *parent = NULL;
+        struct free_extent *e, *new;
+        if (sbi->sb_free_tree_count >= FREE_TREE_MAX) return -ENOSPC;
+        if (!(new = kmalloc(sizeof(struct free_extent), GFP_NOFS))) return -ENOMEM;
+        new->start = start;
+        new->len = len;
+        new->max_len = len;
+        while (*p) {
+                parent = *p;
+                e = rb_entry(parent, struct free_extent, rb);
+                if (e->max_len < len) e->max_len = len;
+                if (start < e->start) p = &parent->rb_left;
+                else p = &parent->rb_right;
+        }
+        rb_link_node(&new->rb, parent, p);
+        rb_insert_augmented(&new->rb, &sbi->sb_free_tree, &free_extent_cb);
+        sbi->sb_free_tree_count++;
+        return 0;
+}
+
+static void free_tree_erase(struct ntfs_sb_info *sbi, struct free_extent *e)
+{
+        rb_erase_augmented(&e->rb, &sbi->sb_free_tree, &free_extent_cb);
+        kfree(e);
+        sbi->sb_free_tree_count--;
+}
+
+/* Find the extent containing sector sec */
+
+static struct free_extent *free_tree_lookup(struct ntfs_sb_info *sbi, secno sec)
+{
+        struct rb_node *n = sbi->sb_free_tree.rb_node;
+        while (n) {
+                struct free_extent *e = rb_entry(n, struct free_extent, rb);
+                if (sec < e->start) n = n->rb_left;
+                else if (sec >= e->start + e->len) n = n->rb_right;
+                else return e;
+        }
+        return NULL;
+}
+
+/*
+ * The extent after e in sector order that is at least len long, or NULL.
+ * Subtrees whose longest extent is too short are skipped.
+ */
+
+static struct free_extent *free_tree_next(struct rb_node *n, unsigned len)
+{
+        struct rb_node *p;
+        for (;;) {
+                if ((p = n->rb_right) && rb_entry(p, struct free_extent, rb)->max_len >= len) {
+                        for (;;) {
+                                if (p->rb_left && rb_entry(p->rb_left, struct free_extent, rb)->max_len >= len)
+                                        p = p->rb_left;
+                                else if (rb_entry(p, struct free_extent, rb)->len >= len)
+                                        return rb_entry(p, struct free_extent, rb);
+                                else p = p->rb_right;
+                        }
+                }
+                while ((p = rb_parent(n)) && n == p->rb_right) n = p;
+                if (!(n = p)) return NULL;
+                if (rb_entry(n, struct free_extent, rb)->len >= len)
+                        return rb_entry(n, struct free_extent, rb);
+        }
+}
+
+/*
+ * Find the lowest sector in [lo, hi), aligned to align, that starts a run
+ * of len free sectors. Returns 0 if there is no such run (sector 0 is
+ * never free).
+ */
+
+static secno free_tree_search(struct ntfs_sb_info *sbi, secno lo, secno hi, unsigned len, unsigned align)
+{
+        struct rb_node *n = sbi->sb_free_tree.rb_node;
+        struct free_extent *e = NULL, *x;
+        secno sec;
+        /* The first extent ending after lo */
+        while (n) {
+                x = rb_entry(n, struct free_extent, rb);
+                if (x->start + x->len > lo) {
+                        e = x;
+                        n = n->rb_left;
+                } else n = n->rb_right;
+        }
+        if (e && e->len < len) e = free_tree_next(&e->rb, len);
+        for (; e && e->start < hi; e = free_tree_next(&e->rb, len)) {
+                sec = (max(e->start, lo) + align - 1) & ~(align - 1);
+                if (sec < hi && sec + len <= e->start + e->len) return sec;
+        }
+        return 0;
+}
+
+void ntfs_drop_free_tree(struct super_block *s)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        struct rb_node *n;
+        while ((n = sbi->sb_free_tree.rb_node)) {
+                rb_erase(n, &sbi->sb_free_tree);
+                kfree(rb_entry(n, struct free_extent, rb));
+        }
+        sbi->sb_free_tree_count = 0;
+        sbi->sb_free_tree_ok = 0;
+        sbi->sb_free_tree_gen++;
+}
+
+static void free_tree_failed(struct super_block *s)
+{
+        printk("NTFS: free space index out of memory or too fragmented, scanning bitmaps instead\n");
+        ntfs_drop_free_tree(s);
+}
+
+/* Sectors sec .. sec+n-1 (within one band) were allocated */
+
+static void free_tree_alloc(struct super_block *s, secno sec, unsigned n)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        struct free_extent *e;
+        secno end;
+        if (!sbi->sb_free_tree_ok) return;
+        if (!(e = free_tree_lookup(sbi, sec)) || sec + n > e->start + e->len) {
+                ntfs_error(s, "free space index out of sync at %08x", sec);
+                ntfs_drop_free_tree(s);
+                return;
+        }
+        end = e->start + e->len;
+        if (sec == e->start && n == e->len) {
+                free_tree_erase(sbi, e);
+                return;
+        }
+        if (sec == e->start) {
+                e->start += n;
+                e->len -= n;
+        } else {
+                e->len = sec - e->start;
+                if (sec + n < end && free_tree_insert(sbi, sec + n, end - (sec + n))) {
+                        free_tree_failed(s);
+                        return;
+                }
+        }
+        free_extent_cb.propagate(&e->rb, NULL);
+}
+
+/* Sectors sec .. sec+n-1 (within one band) were freed */
+
+static void free_tree_free(struct super_block *s, secno sec, unsigned n)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        struct rb_node *p = sbi->sb_free_tree.rb_node, *prev_n = NULL;
+        struct free_extent *e, *prev = NULL, *next = NULL;
+        if (!sbi->sb_free_tree_ok) return;
+        while (p) {
+                e = rb_entry(p, struct free_extent, rb);
+                if (e->start < sec) prev_n = p, p = p->rb_right;
+                else p = p->rb_left;
+        }
+        if (prev_n) {
+                prev = rb_entry(prev_n, struct free_extent, rb);
+                p = rb_next(prev_n);
+        } else p = rb_first(&sbi->sb_free_tree);
+        if (p) next = rb_entry(p, struct free_extent, rb);
+        if (prev && (prev->start + prev->len != sec || (prev->start ^ sec) >> 14)) prev = NULL;
+        if (next && (sec + n != next->start || (next->start ^ sec) >> 14)) next = NULL;
+        if (prev && next) {
+                n += next->len;
+                free_tree_erase(sbi, next);
+        }
+        if (prev) {
+                prev->len += n;
+                free_extent_cb.propagate(&prev->rb, NULL);
+        } else if (next) {
+                next->start = sec;
+                next->len += n;
+                free_extent_cb.propagate(&next->rb, NULL);
+        } else if (free_tree_insert(sbi, sec, n)) free_tree_failed(s);
+}
+
+/*
+ * Build the free extent index from the bitmaps. Called on read/write
+ * mount; on failure the allocator just scans the bitmaps.
+ */
+
+int ntfs_build_free_tree(struct super_block *s)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        struct quad_buffer_head qbh;
+        __le32 *bmp;
+        unsigned n, n_bands, size, q, e;
+        ntfs_drop_free_tree(s);
+        n_bands = (sbi->sb_fs_size + 0x3fff) >> 14;
+        for (n = 0; n < COUNT_RD_AHEAD; n++)
+                ntfs_prefetch_bitmap(s, n);
+        for (n = 0; n < n_bands; n++) {
+                ntfs_prefetch_bitmap(s, n + COUNT_RD_AHEAD);
+                if (!(bmp = ntfs_map_bitmap(s, n, &qbh, "bft"))) goto fail;
+                size = min(sbi->sb_fs_size - (n << 14), 0x4000U);
+                for (q = 0; (q = find_next_bit_le(bmp, size, q)) < size; q = e) {
+                        e = find_next_zero_bit_le(bmp, size, q);
+                        if (free_tree_insert(sbi, (n << 14) + q, e - q)) {
+                                ntfs_brelse4(&qbh);
+                                printk("NTFS: free space index out of memory or too fragmented, scanning bitmaps instead\n");
+                                goto fail;
+                        }
+                }
+                ntfs_brelse4(&qbh);
+        }
+        sbi->sb_free_tree_ok = 1;
+        return 0;
+        fail:
+        ntfs_drop_free_tree(s);
+        return -ENOMEM;
+}
+
+/* Dirty only the sectors of a bitmap holding bits q .. q+len-1 */
+
+static void mark_bmp_dirty(struct quad_buffer_head *qbh, unsigned q, unsigned len)
+{
+        ntfs_mark_4buffers_range_dirty(qbh, q / 8, (q + len - 1) / 8 - q / 8 + 1);
+}
+
+/*
+ * Find a run of at least len free bits in a band bitmap. The run must
+ * start at a multiple of align somewhere in [start, end) and must not
+ * cross the end of the band. Whole words of allocated or free sectors
+ * are skipped at once by find_next_bit_le/find_next_zero_bit_le.
+ * Returns the position of the run or -1.
+ */
+
+static unsigned bmp_find_run(__le32 *bmp, unsigned start, unsigned end, unsigned len, unsigned align)
+{
+        unsigned q = start, e;
+        if (len > 0x4000) return -1;
+        while (1) {
+                q = find_next_bit_le(bmp, end, q);
+                q = (q + align - 1) & ~(align - 1);
+                if (q >= end || q + len > 0x4000) return -1;
+                e = find_next_zero_bit_le(bmp, q + len, q);
+                if (e >= q + len) return q;
+                q = e + 1;
+        }
+}
+
 static secno alloc_in_bmp(struct super_block *s, secno near, unsigned n, unsigned forward)
 {
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
         struct quad_buffer_head qbh;
         __le32 *bmp;
         unsigned bs = near & ~0x3fff;
         unsigned nr = (near & 0x3fff) & ~(n - 1);
-        /*unsigned mnr;*/
-        unsigned i, q;
-        int a, b;
+        unsigned q;
         secno ret = 0;
         if (n != 1 && n != 4) {
                 ntfs_error(s, "Bad allocation size: %d", n);
                 return 0;
         }
+        /* Don't bother with bands that can't hold the run */
+        if (bs != ~0x3fff && sbi->sb_band_free && sbi->sb_band_free[near >> 14] < n + forward)
+                return 0;
+        if (bs != ~0x3fff && sbi->sb_free_tree_ok) {
+                /* Search from the wanted sector to the end, then wrap around */
+                ret = free_tree_search(sbi, bs + nr, bs + 0x4000, n + forward, n);
+                if (!ret && nr)
+                        ret = free_tree_search(sbi, bs, bs + nr, n + forward, n);
+                if (!ret) goto uls;
+                if (!(bmp = ntfs_map_bitmap(s, near >> 14, &qbh, "aib"))) return 0;
+                goto commit;
+        }
         if (bs != ~0x3fff) {
                 if (!(bmp = ntfs_map_bitmap(s, near >> 14, &qbh, "aib"))) goto uls;
         } else {
                 if (!(bmp = ntfs_map_dnode_bitmap(s, &qbh))) goto uls;
         }
-        if (!tstbits(bmp, nr, n + forward)) {
-                ret = bs + nr;
-                goto rt;
-        }
-        q = nr + n; b = 0;
-        while ((a = tstbits(bmp, q, n + forward)) != 0) {
-                q += a;
-                if (n != 1) q = ((q-1)&~(n-1))+n;
-                if (!b) {
-                        if (q>>5 != nr>>5) {
-                                b = 1;
-                                q = nr & 0x1f;
-                        }
-                } else if (q > nr) break;
-        }
-        if (!a) {
+        q = bmp_find_run(bmp, nr, 0x4000, n + forward, n);
+        if (q == -1 && nr)
+                q = bmp_find_run(bmp, 0, nr, n + forward, n);
+        if (q != -1)
                 ret = bs + q;
-                goto rt;
-        }
-        nr >>= 5;
-        /*for (i = nr + 1; i != nr; i++, i &= 0x1ff) */
-        i = nr;
-        do {
-                if (!le32_to_cpu(bmp[i])) goto cont;
-                if (n + forward >= 0x3f && le32_to_cpu(bmp[i]) != 0xffffffff) goto cont;
-                q = i<<5;
-                if (i > 0) {
-                        unsigned k = le32_to_cpu(bmp[i-1]);
-                        while (k & 0x80000000) {
-                                q--; k <<= 1;
-                        }
-                }
-                if (n != 1) q = ((q-1)&~(n-1))+n;
-                while ((a = tstbits(bmp, q, n + forward)) != 0) {
-                        q += a;
-                        if (n != 1) q = ((q-1)&~(n-1))+n;
-                        if (q>>5 > i) break;
-                }
-                if (!a) {
-                        ret = bs + q;
-                        goto rt;
-                }
-                cont:
-                i++, i &= 0x1ff;
-        } while (i != nr);
-        rt:
+        commit:
         if (ret) {
-                if (ntfs_sb(s)->sb_chk && ((ret >> 14) != (bs >> 14) || (le32_to_cpu(bmp[(ret & 0x3fff) >> 5]) | ~(((1 << n) - 1) << (ret & 0x1f))) != 0xffffffff)) {
+                unsigned quads;
+                if ((sbi->sb_chk || sbi->sb_free_tree_ok) && ((ret >> 14) != (bs >> 14) || (le32_to_cpu(bmp[(ret & 0x3fff) >> 5]) | ~(((1 << n) - 1) << (ret & 0x1f))) != 0xffffffff)) {
                         ntfs_error(s, "Allocation doesn't work! Wanted %d, allocated at %08x", n, ret);
+                        if (bs != ~0x3fff) ntfs_drop_free_tree(s);
                         ret = 0;
                         goto b;
                 }
+                quads = ntfs_count_free_quads(bmp, ret & 0x3fff, n);
                 bmp[(ret & 0x3fff) >> 5] &= cpu_to_le32(~(((1 << n) - 1) << (ret & 0x1f)));
-                ntfs_mark_4buffers_dirty(&qbh);
+                mark_bmp_dirty(&qbh, ret & 0x3fff, n);
+                if (bs != ~0x3fff) {
+                        account_free(s, bmp, ret, -n, quads);
+                        free_tree_alloc(s, ret, n);
+                } else if (sbi->sb_n_free_dnodes != -1) sbi->sb_n_free_dnodes--;
         }
         b:
         ntfs_brelse4(&qbh);
@@ -152,6 +451,65 @@ static secno alloc_in_bmp(struct super_block *s, secno near, unsigned n, unsigne
         return ret;
 }
 
+/*
+ * Preallocation windows: a growing file keeps the free sectors right after
+ * its last extent for itself. They are taken out of the free extent index
+ * but stay free in the bitmap, so nothing has to be undone on disk; the
+ * window just goes back to the index on close, truncate or evict, or when
+ * an allocation would fail without it. Windows depend on the index and
+ * are forgotten whenever it is dropped.
+ */
+
+static int window_valid(struct inode *inode)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(inode->i_sb);
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
+        return ntfs_inode->i_prealloc_len && sbi->sb_free_tree_ok &&
+               ntfs_inode->i_prealloc_gen == sbi->sb_free_tree_gen;
+}
+
+void ntfs_release_window(struct inode *inode)
+{
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
+        if (window_valid(inode))
+                free_tree_free(inode->i_sb, ntfs_inode->i_prealloc_start, ntfs_inode->i_prealloc_len);
+        ntfs_inode->i_prealloc_len = 0;
+        list_del_init(&ntfs_inode->i_prealloc_list);
+}
+
+/*
+ * Give the windows of all files back to the index. Done before an
+ * allocation fails, as the free sectors may all be sitting in windows.
+ * Returns whether there was any window.
+ */
+
+static int reclaim_windows(struct super_block *s)
+{
+        struct ntfs_inode_info *ntfs_inode, *next;
+        int r = 0;
+        list_for_each_entry_safe(ntfs_inode, next, &ntfs_sb(s)->sb_windows, i_prealloc_list) {
+                r |= window_valid(&ntfs_inode->vfs_inode);
+                ntfs_release_window(&ntfs_inode->vfs_inode);
+        }
+        return r;
+}
+
+/*
+ * Sectors reserved for delayed allocation are promised to writeback,
+ * along with the anodes they may need. Other allocations may only take
+ * what is left; this returns how many of n sectors they may have.
+ * ntfs_alloc_delayed sets sb_alloc_delayed while it allocates.
+ */
+
+static unsigned alloc_limit(struct super_block *s, unsigned n)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        if (sbi->sb_alloc_delayed) return n;
+        if (sbi->sb_n_free != -1)
+                n = min(n, sbi->sb_n_free > sbi->sb_n_reserved ? sbi->sb_n_free - sbi->sb_n_reserved : 0);
+        return n;
+}
+
 /*
  * Allocation strategy: 1) search place near the sector specified
  *                      2) search bitmap where free sectors last found
@@ -160,32 +518,28 @@ static secno alloc_in_bmp(struct super_block *s, secno near, unsigned n, unsigne
  *                              sectors
  */
 
-secno ntfs_alloc_sector(struct super_block *s, secno near, unsigned n, int forward)
+static secno alloc_sector(struct super_block *s, secno near, unsigned n, int forward)
 {
         secno sec;
         int i;
         unsigned n_bmps;
         struct ntfs_sb_info *sbi = ntfs_sb(s);
-        int f_p = 0;
         int near_bmp;
-        if (forward < 0) {
-                forward = -forward;
-                f_p = 1;
-        }
+        if (alloc_limit(s, n) < n) return 0;
         n_bmps = (sbi->sb_fs_size + 0x4000 - 1) >> 14;
         if (near && near < sbi->sb_fs_size) {
-                if ((sec = alloc_in_bmp(s, near, n, f_p ? forward : forward/4))) goto ret;
+                if ((sec = alloc_in_bmp(s, near, n, forward/4))) goto ret;
                 near_bmp = near >> 14;
         } else near_bmp = n_bmps / 2;
         /*
         if (b != -1) {
-                if ((sec = alloc_in_bmp(s, b<<14, n, f_p ? forward : forward/2))) {
+                if ((sec = alloc_in_bmp(s, b<<14, n, forward/2))) {
                         b &= 0x0fffffff;
                         goto ret;
                 }
-                if (b > 0x10000000) if ((sec = alloc_in_bmp(s, (b&0xfffffff)<<14, n, f_p ? forward : 0))) goto ret;
+                if (b > 0x10000000) if ((sec = alloc_in_bmp(s, (b&0xfffffff)<<14, n, 0))) goto ret;
         */
-        if (!f_p) if (forward > sbi->sb_max_fwd_alloc) forward = sbi->sb_max_fwd_alloc;
+        if (forward > sbi->sb_max_fwd_alloc) forward = sbi->sb_max_fwd_alloc;
         less_fwd:
         for (i = 0; i < n_bmps; i++) {
                 if (near_bmp+i < n_bmps && ((sec = alloc_in_bmp(s, (near_bmp+i) << 14, n, forward)))) {
@@ -207,28 +561,187 @@ secno ntfs_alloc_sector(struct super_block *s, secno near, unsigned n, int forwa
                         goto ret;
                 }
         }
-        if (!f_p) {
-                if (forward) {
-                        sbi->sb_max_fwd_alloc = forward * 3 / 4;
-                        forward /= 2;
-                        goto less_fwd;
-                }
+        if (forward) {
+                sbi->sb_max_fwd_alloc = forward * 3 / 4;
+                forward /= 2;
+                goto less_fwd;
         }
         sec = 0;
         ret:
-        if (sec && f_p) {
-                for (i = 0; i < forward; i++) {
-                        if (!ntfs_alloc_if_possible(s, sec + i + 1)) {
-                                ntfs_error(s, "Prealloc doesn't work! Wanted %d, allocated at %08x, can't allocate %d", forward, sec, i);
-                                sec = 0;
-                                break;
-                        }
+        return sec;
+}
+
+/*
+ * Allocation groups. The home of a directory is the band of its fnode.
+ * Fnodes of files in it are allocated near the directory's fnode, and
+ * their anodes and data near their own fnodes, so the contents of a
+ * directory stay within a small seek window. Homes of new directories are
+ * spread over the volume: a new directory goes to the band with most free
+ * space among DIR_HOME_SCAN bands from a rotor, and the rotor moves past it.
+ */
+
+secno ntfs_dir_home(struct super_block *s)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        unsigned n_bands = (sbi->sb_fs_size + 0x3fff) >> 14;
+        unsigned i, b, best;
+        best = sbi->sb_dir_rotor % n_bands;
+        if (sbi->sb_band_free)
+                for (i = 1; i < DIR_HOME_SCAN && i < n_bands; i++) {
+                        b = (sbi->sb_dir_rotor + i) % n_bands;
+                        if (sbi->sb_band_free[b] > sbi->sb_band_free[best]) best = b;
                 }
+        sbi->sb_dir_rotor = best + 1;
+        /* Not the first sector, 0 would mean no hint for band 0 */
+        return (best << 14) | 1;
+}
+
+/* Clear bits start .. start+len-1 of a band bitmap, a word at a time */
+
+static void bmp_clear_range(__le32 *bmp, unsigned start, unsigned len)
+{
+        while (len) {
+                unsigned bit = start & 0x1f;
+                unsigned k = min(32 - bit, len);
+                u32 mask = (k == 32 ? 0xffffffff : (1U << k) - 1) << bit;
+                bmp[start >> 5] &= cpu_to_le32(~mask);
+                start += k;
+                len -= k;
+        }
+}
+
+/*
+ * Mark a run found free in the mapped band bitmap as allocated, dirty the
+ * bitmap once and release it.
+ */
+
+static int take_run(struct super_block *s, __le32 *bmp, struct quad_buffer_head *qbh,
+                    secno sec, unsigned len, int in_tree)
+{
+        unsigned q = sec & 0x3fff;
+        unsigned quads;
+        if (find_next_zero_bit_le(bmp, q + len, q) < q + len) {
+                ntfs_error(s, "Allocation doesn't work! Wanted %d, allocated at %08x", len, sec);
+                ntfs_drop_free_tree(s);
+                ntfs_brelse4(qbh);
+                return 0;
+        }
+        quads = ntfs_count_free_quads(bmp, q, len);
+        bmp_clear_range(bmp, q, len);
+        account_free(s, bmp, sec, -len, quads);
+        mark_bmp_dirty(qbh, q, len);
+        ntfs_brelse4(qbh);
+        if (in_tree) free_tree_alloc(s, sec, len);
+        return 1;
+}
+
+/*
+ * Allocate a run of at least min_len and at most max_len free sectors in
+ * the band of near, preferring sectors at or after near.
+ */
+
+static secno alloc_run_in_bmp(struct super_block *s, secno near, unsigned min_len,
+                              unsigned max_len, unsigned *len)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        struct quad_buffer_head qbh;
+        struct free_extent *e;
+        __le32 *bmp;
+        secno bs = near & ~0x3fff;
+        unsigned nr = near & 0x3fff;
+        unsigned q;
+        secno sec;
+        if (sbi->sb_band_free && sbi->sb_band_free[near >> 14] < min_len)
+                return 0;
+        if (sbi->sb_free_tree_ok) {
+                sec = free_tree_search(sbi, near, bs + 0x4000, min_len, 1);
+                if (!sec && nr)
+                        sec = free_tree_search(sbi, bs, near, min_len, 1);
+                if (!sec) return 0;
+                e = free_tree_lookup(sbi, sec);
+                *len = min(e->start + e->len - sec, max_len);
+                if (!(bmp = ntfs_map_bitmap(s, near >> 14, &qbh, "arb"))) return 0;
+        } else {
+                if (!(bmp = ntfs_map_bitmap(s, near >> 14, &qbh, "arb"))) return 0;
+                q = bmp_find_run(bmp, nr, 0x4000, min_len, 1);
+                if (q == -1 && nr)
+                        q = bmp_find_run(bmp, 0, nr, min_len, 1);
+                if (q == -1) {
+                        ntfs_brelse4(&qbh);
+                        return 0;
+                }
+                *len = find_next_zero_bit_le(bmp, q + min(max_len, 0x4000 - q), q) - q;
+                sec = bs + q;
         }
+        if (!take_run(s, bmp, &qbh, sec, *len, 1)) return 0;
         return sec;
 }
 
-static secno alloc_in_dirband(struct super_block *s, secno near)
+/*
+ * Allocate a contiguous extent of at least min_len sectors near the sector
+ * specified. As much of the free run found as fits into max_len is taken;
+ * its length is returned in *len. Extents never cross a band boundary.
+ */
+
+static secno alloc_extent(struct super_block *s, secno near, unsigned min_len,
+                         unsigned max_len, unsigned *len)
+{
+        secno sec;
+        int i;
+        unsigned n_bmps;
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        int near_bmp;
+        if (!min_len || min_len > max_len || min_len > 0x4000) {
+                ntfs_error(s, "Bad extent size: %u-%u", min_len, max_len);
+                return 0;
+        }
+        if ((max_len = alloc_limit(s, max_len)) < min_len) return 0;
+        n_bmps = (sbi->sb_fs_size + 0x4000 - 1) >> 14;
+        if (near && near < sbi->sb_fs_size) {
+                if ((sec = alloc_run_in_bmp(s, near, min_len, max_len, len))) return sec;
+                near_bmp = near >> 14;
+        } else near_bmp = n_bmps / 2;
+        for (i = 0; i < n_bmps; i++) {
+                if (near_bmp+i < n_bmps && ((sec = alloc_run_in_bmp(s, (near_bmp+i) << 14, min_len, max_len, len)))) {
+                        sbi->sb_c_bitmap = near_bmp+i;
+                        return sec;
+                }
+                if (near_bmp-i-1 >= 0 && ((sec = alloc_run_in_bmp(s, (near_bmp-i-1) << 14, min_len, max_len, len)))) {
+                        sbi->sb_c_bitmap = near_bmp-i-1;
+                        return sec;
+                }
+        }
+        return 0;
+}
+
+/*
+ * Allocate up to max free sectors starting exactly at sec, e.g. to extend
+ * an existing extent in place. Returns the number of sectors allocated.
+ */
+
+unsigned ntfs_alloc_run_at(struct super_block *s, secno sec, unsigned max)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        struct quad_buffer_head qbh;
+        struct free_extent *e;
+        __le32 *bmp;
+        unsigned q = sec & 0x3fff, n;
+        if (sec >= sbi->sb_fs_size) return 0;
+        if (!(max = alloc_limit(s, min(max, 0x4000 - q)))) return 0;
+        if (sbi->sb_free_tree_ok) {
+                if (!(e = free_tree_lookup(sbi, sec))) return 0;
+                max = min(max, e->start + e->len - sec);
+        }
+        if (!(bmp = ntfs_map_bitmap(s, sec >> 14, &qbh, "ara"))) return 0;
+        if (!(n = find_next_zero_bit_le(bmp, q + max, q) - q)) {
+                ntfs_brelse4(&qbh);
+                return 0;
+        }
+        if (!take_run(s, bmp, &qbh, sec, n, 1)) return 0;
+        return n;
+}
+
+secno ntfs_alloc_in_dirband(struct super_block *s, secno near)
 {
         unsigned nr = near;
         secno sec;
@@ -244,113 +757,403 @@ static secno alloc_in_dirband(struct super_block *s, secno near)
         return ((sec & 0x3fff) << 2) + sbi->sb_dirband_start;
 }
 
+/* Set up a window of up to len sectors starting at sector end */
+
+void ntfs_prealloc_window(struct inode *inode, secno end, unsigned len)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(inode->i_sb);
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
+        struct free_extent *e;
+        if (window_valid(inode) && ntfs_inode->i_prealloc_start == end) return;
+        ntfs_release_window(inode);
+        if (!sbi->sb_free_tree_ok || !(e = free_tree_lookup(sbi, end))) return;
+        len = min(len, e->start + e->len - end);
+        free_tree_alloc(inode->i_sb, end, len);
+        if (!sbi->sb_free_tree_ok) return;
+        ntfs_inode->i_prealloc_start = end;
+        ntfs_inode->i_prealloc_len = len;
+        ntfs_inode->i_prealloc_gen = sbi->sb_free_tree_gen;
+        list_add(&ntfs_inode->i_prealloc_list, &sbi->sb_windows);
+}
+
+/* Allocate up to max sectors at sec from the inode's window */
+
+unsigned ntfs_alloc_from_window(struct inode *inode, secno sec, unsigned max)
+{
+        struct super_block *s = inode->i_sb;
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
+        struct quad_buffer_head qbh;
+        __le32 *bmp;
+        unsigned n;
+        if (!window_valid(inode) || ntfs_inode->i_prealloc_start != sec) return 0;
+        if (!(n = alloc_limit(s, min(max, ntfs_inode->i_prealloc_len)))) return 0;
+        if (!(bmp = ntfs_map_bitmap(s, sec >> 14, &qbh, "afw"))) return 0;
+        if (!take_run(s, bmp, &qbh, sec, n, 0)) {
+                ntfs_inode->i_prealloc_len = 0;
+                return 0;
+        }
+        ntfs_inode->i_prealloc_start += n;
+        ntfs_inode->i_prealloc_len -= n;
+        return n;
+}
+
 /* Alloc sector if it's free */
 
 int ntfs_alloc_if_possible(struct super_block *s, secno sec)
+{
+        return ntfs_alloc_run_at(s, sec, 1);
+}
+
+/* Set bits start .. start+len-1 of a band bitmap, whole words at once */
+
+static void bmp_set_range(__le32 *bmp, unsigned start, unsigned len)
+{
+        unsigned bit = start & 0x1f;
+        if (bit) {
+                unsigned k = min(32 - bit, len);
+                bmp[start >> 5] |= cpu_to_le32(((1U << k) - 1) << bit);
+                start += k;
+                len -= k;
+        }
+        if (len >= 32) {
+                memset(&bmp[start >> 5], 0xff, (len >> 5) * 4);
+                start += len & ~0x1f;
+                len &= 0x1f;
+        }
+        if (len) bmp[start >> 5] |= cpu_to_le32((1U << len) - 1);
+}
+
+/*
+ * Free a run lying within the mapped band bitmap. Stops at the first
+ * sector that is not allocated; returns the number of sectors freed.
+ * The caller dirties the bitmap.
+ */
+
+static unsigned free_in_bmp(struct super_block *s, __le32 *bmp, secno sec, unsigned len)
+{
+        unsigned q = sec & 0x3fff;
+        unsigned p = find_next_bit_le(bmp, q + len, q);
+        if (p < q + len) {
+                ntfs_error(s, "sector %08x not allocated", sec - q + p);
+                len = p - q;
+        }
+        if (len) {
+                unsigned quads = ntfs_count_free_quads(bmp, q, len);
+                bmp_set_range(bmp, q, len);
+                account_free(s, bmp, sec, len, quads);
+                free_tree_free(s, sec, len);
+        }
+        return len;
+}
+
+static inline int bad_free(secno sec, unsigned n)
+{
+        return sec < 0x12 || sec + n < sec;
+}
+
+static inline int bad_extent(struct super_block *s, secno sec, unsigned n)
+{
+        return bad_free(sec, n) || sec + n > ntfs_sb(s)->sb_fs_size;
+}
+
+static int free_check(struct super_block *s, secno sec, unsigned n)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        if (bad_extent(s, sec, n)) {
+                ntfs_error(s, "Trying to free reserved sector %08x", sec);
+                return 1;
+        }
+        sbi->sb_max_fwd_alloc += n > 0xffff ? 0xffff : n;
+        if (sbi->sb_max_fwd_alloc > 0xffffff) sbi->sb_max_fwd_alloc = 0xffffff;
+        return 0;
+}
+
+static void free_run(struct super_block *s, secno sec, unsigned n)
 {
         struct quad_buffer_head qbh;
         __le32 *bmp;
-        if (!(bmp = ntfs_map_bitmap(s, sec >> 14, &qbh, "aip"))) goto end;
-        if (le32_to_cpu(bmp[(sec & 0x3fff) >> 5]) & (1 << (sec & 0x1f))) {
-                bmp[(sec & 0x3fff) >> 5] &= cpu_to_le32(~(1 << (sec & 0x1f)));
-                ntfs_mark_4buffers_dirty(&qbh);
+        unsigned k, freed;
+        while (n) {
+                k = min(n, 0x4000 - (sec & 0x3fff));
+                if (!(bmp = ntfs_map_bitmap(s, sec >> 14, &qbh, "free"))) return;
+                freed = free_in_bmp(s, bmp, sec, k);
+                if (freed) mark_bmp_dirty(&qbh, sec & 0x3fff, freed);
                 ntfs_brelse4(&qbh);
-                return 1;
+                if (freed != k) return;
+                sec += k;
+                n -= k;
         }
-        ntfs_brelse4(&qbh);
-        end:
-        return 0;
 }
 
-/* Free sectors in bitmaps */
+static inline int in_dirband(struct super_block *s, secno sec)
+{
+        return sec >= ntfs_sb(s)->sb_dirband_start &&
+               sec < ntfs_sb(s)->sb_dirband_start + ntfs_sb(s)->sb_dirband_size;
+}
 
-void ntfs_free_sectors(struct super_block *s, secno sec, unsigned n)
+static void free_in_dirband(struct super_block *s, dnode_secno dno)
 {
         struct quad_buffer_head qbh;
         __le32 *bmp;
-        struct ntfs_sb_info *sbi = ntfs_sb(s);
-        /*printk("2 - ");*/
-        if (!n) return;
-        if (sec < 0x12) {
-                ntfs_error(s, "Trying to free reserved sector %08x", sec);
+        unsigned ssec = (dno - ntfs_sb(s)->sb_dirband_start) / 4;
+        if (!(bmp = ntfs_map_dnode_bitmap(s, &qbh))) {
                 return;
         }
-        sbi->sb_max_fwd_alloc += n > 0xffff ? 0xffff : n;
-        if (sbi->sb_max_fwd_alloc > 0xffffff) sbi->sb_max_fwd_alloc = 0xffffff;
-        new_map:
-        if (!(bmp = ntfs_map_bitmap(s, sec >> 14, &qbh, "free"))) {
-                return;
+        bmp[ssec >> 5] |= cpu_to_le32(1 << (ssec & 0x1f));
+        mark_bmp_dirty(&qbh, ssec, 1);
+        ntfs_brelse4(&qbh);
+        if (ntfs_sb(s)->sb_n_free_dnodes != -1) ntfs_sb(s)->sb_n_free_dnodes++;
+}
+
+/*
+ * With the discard mount option, freed sectors are queued and discarded in
+ * batches by a worker. They stay allocated in the bitmaps until then, so
+ * nobody can reuse them while the discard is in flight. Adjacent frees are
+ * merged into one request. If we can't queue, the sectors are just freed.
+ */
+
+struct discard_extent {
+        struct list_head list;
+        secno start;
+        unsigned len;
+};
+
+static int queue_discard(struct super_block *s, secno sec, unsigned n)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        struct discard_extent *d;
+        if (!list_empty(&sbi->sb_discard_list)) {
+                d = list_entry(sbi->sb_discard_list.prev, struct discard_extent, list);
+                if (d->start + d->len == sec && in_dirband(s, d->start) == in_dirband(s, sec)) {
+                        d->len += n;
+                        return 1;
+                }
         }
-        new_tst:
-        if ((le32_to_cpu(bmp[(sec & 0x3fff) >> 5]) >> (sec & 0x1f) & 1)) {
-                ntfs_error(s, "sector %08x not allocated", sec);
-                ntfs_brelse4(&qbh);
-                return;
+        if (!(d = kmalloc(sizeof(struct discard_extent), GFP_NOFS))) return 0;
+        d->start = sec;
+        d->len = n;
+        list_add_tail(&d->list, &sbi->sb_discard_list);
+        schedule_delayed_work(&sbi->sb_discard_work, DISCARD_DELAY);
+        return 1;
+}
+
+/* Free the extents of a discard list, with the lock held */
+
+static void free_discarded(struct super_block *s, struct list_head *list)
+{
+        struct discard_extent *d, *n;
+        list_for_each_entry_safe(d, n, list, list) {
+                if (in_dirband(s, d->start)) {
+                        secno sec;
+                        for (sec = d->start; sec < d->start + d->len; sec += 4)
+                                free_in_dirband(s, sec);
+                } else free_run(s, d->start, d->len);
+                kfree(d);
         }
-        bmp[(sec & 0x3fff) >> 5] |= cpu_to_le32(1 << (sec & 0x1f));
-        if (!--n) {
-                ntfs_mark_4buffers_dirty(&qbh);
-                ntfs_brelse4(&qbh);
-                return;
+        INIT_LIST_HEAD(list);
+}
+
+/* Discard and free everything queued so far. Called without the lock. */
+
+void ntfs_flush_discards(struct super_block *s)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        struct discard_extent *d;
+        LIST_HEAD(list);
+        ntfs_lock(s);
+        list_splice_init(&sbi->sb_discard_list, &list);
+        ntfs_unlock(s);
+        if (list_empty(&list)) return;
+        /* Errors are ignored, a discard is only a hint */
+        list_for_each_entry(d, &list, list)
+                sb_issue_discard(s, d->start, d->len, GFP_NOFS, 0);
+        ntfs_lock(s);
+        free_discarded(s, &list);
+        ntfs_unlock(s);
+}
+
+/*
+ * Free the queued extents without discarding them, when an allocation or
+ * a reservation would fail otherwise: the space is needed more than the
+ * discard. Extents already taken by the worker are not waited for.
+ * Returns whether anything was queued.
+ */
+
+static int release_discards(struct super_block *s)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        if (list_empty(&sbi->sb_discard_list)) return 0;
+        free_discarded(s, &sbi->sb_discard_list);
+        return 1;
+}
+
+void ntfs_discard_work(struct work_struct *work)
+{
+        struct ntfs_sb_info *sbi = container_of(to_delayed_work(work), struct ntfs_sb_info, sb_discard_work);
+        ntfs_flush_discards(sbi->sb_s);
+}
+
+/*
+ * Before an allocation fails for lack of space, the windows of all files
+ * and the queued discards are given back. Returns whether there was
+ * anything to give back.
+ */
+
+static int reclaim_space(struct super_block *s)
+{
+        int r = reclaim_windows(s);
+        return release_discards(s) | r;
+}
+
+secno ntfs_alloc_sector(struct super_block *s, secno near, unsigned n, int forward)
+{
+        secno sec = alloc_sector(s, near, n, forward);
+        if (!sec && reclaim_space(s)) sec = alloc_sector(s, near, n, forward);
+        return sec;
+}
+
+/* Space is reclaimed only when not even a single sector is left */
+
+secno ntfs_alloc_extent(struct super_block *s, secno near, unsigned min_len,
+                        unsigned max_len, unsigned *len)
+{
+        secno sec = alloc_extent(s, near, min_len, max_len, len);
+        if (!sec && min_len == 1 && reclaim_space(s))
+                sec = alloc_extent(s, near, min_len, max_len, len);
+        return sec;
+}
+
+/*
+ * Anodes the allocation tree of a file may need for n more sectors. At
+ * worst each sector becomes an extent of its own; 40 extents fit in an
+ * anode and 60 anodes under each anode of the level above.
+ */
+
+static unsigned da_meta_secs(unsigned n)
+{
+        unsigned level, total = 0;
+        if (!n) return 0;
+        for (level = (n + 39) / 40; level > 1; level = (level + 59) / 60)
+                total += level;
+        return total + 1;
+}
+
+/*
+ * Reserve space for delayed allocation of n more sectors of a file, and
+ * for the anodes they may need. The sectors are allocated later, at
+ * writeback; until then they only count against the free space.
+ */
+
+int ntfs_reserve_sectors(struct inode *inode, unsigned n)
+{
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
+        struct ntfs_sb_info *sbi = ntfs_sb(inode->i_sb);
+        unsigned meta = da_meta_secs(ntfs_inode->i_da_secs + n) - ntfs_inode->i_da_meta;
+        if (sbi->sb_n_free != -1 &&
+            sbi->sb_n_free < sbi->sb_n_reserved + n + meta) {
+                if (!release_discards(inode->i_sb) ||
+                    sbi->sb_n_free < sbi->sb_n_reserved + n + meta)
+                        return -ENOSPC;
         }
-        if (!(++sec & 0x3fff)) {
-                ntfs_mark_4buffers_dirty(&qbh);
-                ntfs_brelse4(&qbh);
-                goto new_map;
+        sbi->sb_n_reserved += n + meta;
+        ntfs_inode->i_da_secs += n;
+        ntfs_inode->i_da_meta += meta;
+        return 0;
+}
+
+/* Release n reserved sectors of a file and the anodes no longer needed */
+
+void ntfs_unreserve_sectors(struct inode *inode, unsigned n)
+{
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
+        struct ntfs_sb_info *sbi = ntfs_sb(inode->i_sb);
+        unsigned meta;
+        if (ntfs_inode->i_da_secs < n) {
+                ntfs_error(inode->i_sb, "unreserving %u sectors, only %u reserved", n, ntfs_inode->i_da_secs);
+                n = ntfs_inode->i_da_secs;
         }
-        goto new_tst;
+        ntfs_inode->i_da_secs -= n;
+        meta = ntfs_inode->i_da_meta - da_meta_secs(ntfs_inode->i_da_secs);
+        ntfs_inode->i_da_meta -= meta;
+        sbi->sb_n_reserved -= n + meta;
+}
+
+/* Free sectors in bitmaps */
+
+void ntfs_free_sectors(struct super_block *s, secno sec, unsigned n)
+{
+        /*printk("2 - ");*/
+        if (!n) return;
+        if (free_check(s, sec, n)) return;
+        if (ntfs_sb(s)->sb_discard && queue_discard(s, sec, n)) return;
+        free_run(s, sec, n);
 }
 
 /*
- * Check if there are at least n free dnodes on the filesystem.
- * Called before adding to dnode. If we run out of space while
- * splitting dnodes, it would corrupt dnode tree.
+ * Free a batch of extents, such as all the leaves of an allocation
+ * node. The bands are visited in ascending order and each band bitmap
+ * is mapped only once, however the extents are ordered.
+ * With discard, the extents are just queued one by one.
  */
 
-int ntfs_check_free_dnodes(struct super_block *s, int n)
+void ntfs_free_extents(struct super_block *s, struct bplus_leaf_node *ext, int n)
 {
-        int n_bmps = (ntfs_sb(s)->sb_fs_size + 0x4000 - 1) >> 14;
-        int b = ntfs_sb(s)->sb_c_bitmap & 0x0fffffff;
-        int i, j;
-        __le32 *bmp;
         struct quad_buffer_head qbh;
-        if ((bmp = ntfs_map_dnode_bitmap(s, &qbh))) {
-                for (j = 0; j < 512; j++) {
-                        unsigned k;
-                        if (!le32_to_cpu(bmp[j])) continue;
-                        for (k = le32_to_cpu(bmp[j]); k; k >>= 1) if (k & 1) if (!--n) {
-                                ntfs_brelse4(&qbh);
-                                return 0;
-                        }
-                }
+        __le32 *bmp;
+        unsigned band = 0, next, first, last;
+        secno sec, end;
+        unsigned len;
+        int i;
+        if (ntfs_sb(s)->sb_discard) {
+                for (i = 0; i < n; i++)
+                        ntfs_free_sectors(s, le32_to_cpu(ext[i].disk_secno), le32_to_cpu(ext[i].length));
+                return;
         }
-        ntfs_brelse4(&qbh);
-        i = 0;
-        if (ntfs_sb(s)->sb_c_bitmap != -1) {
-                bmp = ntfs_map_bitmap(s, b, &qbh, "chkdn1");
-                goto chk_bmp;
-        }
-        chk_next:
-        if (i == b) i++;
-        if (i >= n_bmps) return 1;
-        bmp = ntfs_map_bitmap(s, i, &qbh, "chkdn2");
-        chk_bmp:
-        if (bmp) {
-                for (j = 0; j < 512; j++) {
-                        u32 k;
-                        if (!le32_to_cpu(bmp[j])) continue;
-                        for (k = 0xf; k; k <<= 4)
-                                if ((le32_to_cpu(bmp[j]) & k) == k) {
-                                        if (!--n) {
-                                                ntfs_brelse4(&qbh);
-                                                return 0;
-                                        }
-                                }
+        /* Extents that fail the check are skipped below */
+        for (i = 0; i < n; i++)
+                if (le32_to_cpu(ext[i].length))
+                        free_check(s, le32_to_cpu(ext[i].disk_secno), le32_to_cpu(ext[i].length));
+        for (;;) {
+                next = -1;
+                for (i = 0; i < n; i++) {
+                        sec = le32_to_cpu(ext[i].disk_secno);
+                        if (!(len = le32_to_cpu(ext[i].length)) || bad_extent(s, sec, len)) continue;
+                        first = sec >> 14;
+                        last = (sec + len - 1) >> 14;
+                        if (last < band) continue;
+                        if (first < band) first = band;
+                        if (first < next) next = first;
+                }
+                if (next == -1) return;
+                band = next + 1;
+                if (!(bmp = ntfs_map_bitmap(s, next, &qbh, "fext"))) continue;
+                for (i = 0; i < n; i++) {
+                        sec = le32_to_cpu(ext[i].disk_secno);
+                        if (!(len = le32_to_cpu(ext[i].length)) || bad_extent(s, sec, len)) continue;
+                        end = sec + len;
+                        if (sec >> 14 > next || (end - 1) >> 14 < next) continue;
+                        if (sec >> 14 < next) sec = next << 14;
+                        if ((end - 1) >> 14 > next) end = (next + 1) << 14;
+                        if ((len = free_in_bmp(s, bmp, sec, end - sec)))
+                                mark_bmp_dirty(&qbh, sec & 0x3fff, len);
                 }
                 ntfs_brelse4(&qbh);
         }
-        i++;
-        goto chk_next;
+}
+
+/*
+ * Check if there are at least n free dnodes on the filesystem.
+ * Called before adding to dnode. If we run out of space while
+ * splitting dnodes, it would corrupt dnode tree. Free dnodes in the
+ * directory band and free aligned quads elsewhere are counted as the
+ * bitmaps change, so this is just a comparison. Quads outside the
+ * band may not use space promised to delayed allocation.
+ */
+
+int ntfs_check_free_dnodes(struct super_block *s, int n)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        return sbi->sb_n_free_dnodes + alloc_limit(s, sbi->sb_n_free_quads * 4) / 4 < n;
 }
 
 void ntfs_free_dnode(struct super_block *s, dnode_secno dno)
@@ -359,19 +1162,11 @@ void ntfs_free_dnode(struct super_block *s, dnode_secno dno)
                 ntfs_error(s, "ntfs_free_dnode: dnode %08x not aligned", dno);
                 return;
         }
-        if (dno < ntfs_sb(s)->sb_dirband_start ||
-            dno >= ntfs_sb(s)->sb_dirband_start + ntfs_sb(s)->sb_dirband_size) {
+        if (!in_dirband(s, dno)) {
                 ntfs_free_sectors(s, dno, 4);
         } else {
-                struct quad_buffer_head qbh;
-                __le32 *bmp;
-                unsigned ssec = (dno - ntfs_sb(s)->sb_dirband_start) / 4;
-                if (!(bmp = ntfs_map_dnode_bitmap(s, &qbh))) {
-                        return;
-                }
-                bmp[ssec >> 5] |= cpu_to_le32(1 << (ssec & 0x1f));
-                ntfs_mark_4buffers_dirty(&qbh);
-                ntfs_brelse4(&qbh);
+                if (ntfs_sb(s)->sb_discard && queue_discard(s, dno, 4)) return;
+                free_in_dirband(s, dno);
         }
 }
 
@@ -379,12 +1174,12 @@ struct dnode *ntfs_alloc_dnode(struct super_block *s, secno near,
                          dnode_secno *dno, struct quad_buffer_head *qbh)
 {
         struct dnode *d;
-        if (ntfs_count_one_bitmap(s, ntfs_sb(s)->sb_dmap) > FREE_DNODES_ADD) {
-                if (!(*dno = alloc_in_dirband(s, near)))
+        if (ntfs_sb(s)->sb_n_free_dnodes > FREE_DNODES_ADD) {
+                if (!(*dno = ntfs_alloc_in_dirband(s, near)))
                         if (!(*dno = ntfs_alloc_sector(s, near, 4, 0))) return NULL;
         } else {
                 if (!(*dno = ntfs_alloc_sector(s, near, 4, 0)))
-                        if (!(*dno = alloc_in_dirband(s, near))) return NULL;
+                        if (!(*dno = ntfs_alloc_in_dirband(s, near))) return NULL;
         }
         if (!(d = ntfs_get_4sectors(s, *dno, qbh))) {
                 ntfs_free_dnode(s, *dno);
@@ -435,3 +1230,118 @@ struct anode *ntfs_alloc_anode(struct super_block *s, secno near, anode_secno *a
         a->btree.first_free = cpu_to_le16(8);
         return a;
 }
+
+/*
+ * FITRIM: discard the free runs of at least minlen sectors between start
+ * and end. Like the discard mount option, each run is marked allocated
+ * while its discard is in flight, so that it can't be reused meanwhile
+ * and the lock needn't be held across the discard.
+ */
+
+static int trim_extent(struct super_block *s, secno sec, unsigned n, unsigned *trimmed)
+{
+        int r = sb_issue_discard(s, sec, n, GFP_NOFS, 0);
+        ntfs_lock(s);
+        if (in_dirband(s, sec)) {
+                secno dno;
+                for (dno = sec; dno < sec + n; dno += 4)
+                        free_in_dirband(s, dno);
+        } else free_run(s, sec, n);
+        ntfs_unlock(s);
+        if (r) return r;
+        *trimmed += n;
+        return 0;
+}
+
+/*
+ * Find the first free run of at least minlen sectors in [lo, hi) of a
+ * band and take it. Preallocation windows are not free in the index, so
+ * they are left alone. Returns its start, 0 if there is none or -1 if
+ * the bitmap can't be read.
+ */
+
+static secno trim_take_run(struct super_block *s, unsigned band, secno lo, secno hi,
+                           unsigned minlen, unsigned *len)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        struct quad_buffer_head qbh;
+        struct free_extent *e;
+        __le32 *bmp;
+        unsigned q, end;
+        secno sec;
+        if (sbi->sb_band_free && sbi->sb_band_free[band] < minlen) return 0;
+        if (!(bmp = ntfs_map_bitmap(s, band, &qbh, "trim"))) return -1;
+        if (sbi->sb_free_tree_ok) {
+                for (sec = lo; (sec = free_tree_search(sbi, sec, hi, minlen, 1)); sec = e->start + e->len) {
+                        e = free_tree_lookup(sbi, sec);
+                        *len = min(e->start + e->len, hi) - sec;
+                        if (*len >= minlen) goto take;
+                }
+        } else {
+                for (q = lo & 0x3fff; (q = find_next_bit_le(bmp, hi - (band << 14), q)) < hi - (band << 14); q = end) {
+                        end = find_next_zero_bit_le(bmp, hi - (band << 14), q);
+                        sec = (band << 14) + q;
+                        *len = end - q;
+                        if (*len >= minlen) goto take;
+                }
+        }
+        ntfs_brelse4(&qbh);
+        return 0;
+        take:
+        if (!take_run(s, bmp, &qbh, sec, *len, 1)) return -1;
+        return sec;
+}
+
+int ntfs_trim_fs(struct super_block *s, secno start, secno end, unsigned minlen, unsigned *trimmed)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        struct quad_buffer_head qbh;
+        __le32 *bmp;
+        unsigned band, q, e, n, len;
+        secno lo, sec;
+        int r;
+        *trimmed = 0;
+        if (end > sbi->sb_fs_size) end = sbi->sb_fs_size;
+        if (!minlen) minlen = 1;
+        for (band = start >> 14; start < end && band <= (end - 1) >> 14; band++) {
+                lo = max(start, band << 14);
+                while (lo < min(end, (band + 1) << 14)) {
+                        if (fatal_signal_pending(current)) return -EINTR;
+                        ntfs_lock(s);
+                        sec = trim_take_run(s, band, lo, min(end, (band + 1) << 14), minlen, &len);
+                        ntfs_unlock(s);
+                        if (sec == -1) return -EIO;
+                        if (!sec) break;
+                        if ((r = trim_extent(s, sec, len, trimmed))) return r;
+                        lo = sec + len;
+                        cond_resched();
+                }
+        }
+        /* Free dnodes in the directory band, a bit for 4 sectors */
+        if (start >= sbi->sb_dirband_start + sbi->sb_dirband_size || end <= sbi->sb_dirband_start)
+                return 0;
+        q = start > sbi->sb_dirband_start ? (start - sbi->sb_dirband_start + 3) / 4 : 0;
+        n = min(min(sbi->sb_dirband_size, end - sbi->sb_dirband_start) / 4, 0x4000U);
+        while (q < n) {
+                if (fatal_signal_pending(current)) return -EINTR;
+                ntfs_lock(s);
+                if (!(bmp = ntfs_map_dnode_bitmap(s, &qbh))) {
+                        ntfs_unlock(s);
+                        return -EIO;
+                }
+                for (; (q = find_next_bit_le(bmp, n, q)) < n; q = e)
+                        if ((e = find_next_zero_bit_le(bmp, n, q)) - q >= (minlen + 3) / 4) break;
+                if (q < n) {
+                        bmp_clear_range(bmp, q, e - q);
+                        mark_bmp_dirty(&qbh, q, e - q);
+                        if (sbi->sb_n_free_dnodes != -1) sbi->sb_n_free_dnodes -= e - q;
+                }
+                ntfs_brelse4(&qbh);
+                ntfs_unlock(s);
+                if (q >= n) break;
+                if ((r = trim_extent(s, sbi->sb_dirband_start + q * 4, (e - q) * 4, trimmed))) return r;
+                q = e;
+                cond_resched();
+        }
+        return 0;
+}
@@ -22,6 +22,177 @@
 
 #include "ntfs_fn.h"
 
+/*
+ * Extent cache. Each file keeps a sorted array of the extents it has
+ * looked up, filled a whole leaf at a time, so that mapping a block
+ * doesn't descend the anodes again. The arrays are only used with
+ * ntfs_lock held; a shrinker frees them under memory pressure.
+ */
+
+#define MAX_CACHED_EXTENTS      4096
+
+static LIST_HEAD(extent_lru);           /* inodes with an array, oldest first */
+static DEFINE_SPINLOCK(extent_lru_lock);
+static unsigned long extent_count;      /* slots allocated in all arrays */
+
+/* Index of the first cached extent that ends after sec */
+
+static unsigned extent_pos(struct ntfs_inode_info *ntfs_inode, unsigned sec)
+{
+        unsigned lo = 0, hi = ntfs_inode->i_n_extents;
+        while (lo < hi) {
+                unsigned mid = (lo + hi) / 2;
+                struct ntfs_extent *e = &ntfs_inode->i_extents[mid];
+                if (e->file_sec + e->len <= sec) lo = mid + 1;
+                else hi = mid;
+        }
+        return lo;
+}
+
+/* Find a sector in the extent cache and make its extent the current one */
+
+int ntfs_find_extent(struct inode *inode, unsigned sec)
+{
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
+        struct ntfs_extent *e;
+        unsigned p;
+        p = extent_pos(ntfs_inode, sec);
+        if (p == ntfs_inode->i_n_extents) return 0;
+        e = &ntfs_inode->i_extents[p];
+        if (e->file_sec > sec) return 0;
+        ntfs_set_extent(inode, e->file_sec, e->disk_sec, e->len);
+        return 1;
+}
+
+static int grow_extents(struct ntfs_inode_info *ntfs_inode)
+{
+        struct ntfs_extent *e;
+        unsigned max = ntfs_inode->i_max_extents ? ntfs_inode->i_max_extents * 2 : 8;
+        if (max > MAX_CACHED_EXTENTS) return 0;
+        if (!(e = kmalloc(max * sizeof(struct ntfs_extent), GFP_NOFS))) return 0;
+        memcpy(e, ntfs_inode->i_extents, ntfs_inode->i_n_extents * sizeof(struct ntfs_extent));
+        kfree(ntfs_inode->i_extents);
+        ntfs_inode->i_extents = e;
+        spin_lock(&extent_lru_lock);
+        extent_count += max - ntfs_inode->i_max_extents;
+        ntfs_inode->i_max_extents = max;
+        list_move_tail(&ntfs_inode->i_extent_lru, &extent_lru);
+        spin_unlock(&extent_lru_lock);
+        return 1;
+}
+
+/* Add an extent to the cache; it may already be there */
+
+void ntfs_cache_extent(struct inode *inode, unsigned file_sec, unsigned disk_sec, unsigned len)
+{
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
+        struct ntfs_extent *e;
+        unsigned p;
+        if (!len) return;
+        p = extent_pos(ntfs_inode, file_sec);
+        if (p < ntfs_inode->i_n_extents && ntfs_inode->i_extents[p].file_sec < file_sec + len) return;
+        if (p) {
+                e = &ntfs_inode->i_extents[p - 1];
+                if (e->file_sec + e->len == file_sec && e->disk_sec + e->len == disk_sec) {
+                        e->len += len;
+                        return;
+                }
+        }
+        if (ntfs_inode->i_n_extents == ntfs_inode->i_max_extents)
+                if (!grow_extents(ntfs_inode)) return;
+        e = &ntfs_inode->i_extents[p];
+        memmove(e + 1, e, (ntfs_inode->i_n_extents - p) * sizeof(struct ntfs_extent));
+        e->file_sec = file_sec;
+        e->disk_sec = disk_sec;
+        e->len = len;
+        ntfs_inode->i_n_extents++;
+}
+
+static void cache_leaf(struct inode *inode, struct bplus_header *btree)
+{
+        int i;
+        for (i = 0; i < btree->n_used_nodes; i++)
+                ntfs_cache_extent(inode, le32_to_cpu(btree->u.external[i].file_secno),
+                                  le32_to_cpu(btree->u.external[i].disk_secno),
+                                  le32_to_cpu(btree->u.external[i].length));
+}
+
+/* Forget the cached extents past the first secs sectors */
+
+void ntfs_truncate_extents(struct inode *inode, unsigned secs)
+{
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
+        unsigned p = extent_pos(ntfs_inode, secs);
+        if (p < ntfs_inode->i_n_extents && ntfs_inode->i_extents[p].file_sec < secs) {
+                ntfs_inode->i_extents[p].len = secs - ntfs_inode->i_extents[p].file_sec;
+                p++;
+        }
+        ntfs_inode->i_n_extents = p;
+}
+
+static void free_extents(struct ntfs_inode_info *ntfs_inode)
+{
+        list_del_init(&ntfs_inode->i_extent_lru);
+        extent_count -= ntfs_inode->i_max_extents;
+        kfree(ntfs_inode->i_extents);
+        ntfs_inode->i_extents = NULL;
+        ntfs_inode->i_n_extents = ntfs_inode->i_max_extents = 0;
+}
+
+/* Free the extent cache; either ntfs_lock is held or the inode is dying */
+
+void ntfs_drop_extents(struct inode *inode)
+{
+        spin_lock(&extent_lru_lock);
+        free_extents(ntfs_i(inode));
+        spin_unlock(&extent_lru_lock);
+}
+
+static unsigned long extent_shrink_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+        return extent_count;
+}
+
+/* Inodes whose filesystem is busy are skipped, ntfs_lock can't be waited for here */
+
+static unsigned long extent_shrink_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+        struct ntfs_inode_info *ntfs_inode;
+        struct mutex *m;
+        unsigned long freed = 0, scanned = 0;
+        if (!(sc->gfp_mask & __GFP_FS)) return SHRINK_STOP;
+        spin_lock(&extent_lru_lock);
+        while (freed < sc->nr_to_scan && scanned++ < sc->nr_to_scan && !list_empty(&extent_lru)) {
+                ntfs_inode = list_first_entry(&extent_lru, struct ntfs_inode_info, i_extent_lru);
+                m = &ntfs_sb(ntfs_inode->vfs_inode.i_sb)->ntfs_mutex;
+                if (!mutex_trylock(m)) {
+                        list_move_tail(&ntfs_inode->i_extent_lru, &extent_lru);
+                        continue;
+                }
+                freed += ntfs_inode->i_max_extents;
+                free_extents(ntfs_inode);
+                mutex_unlock(m);
+        }
+        spin_unlock(&extent_lru_lock);
+        return freed;
+}
+
+static struct shrinker extent_shrinker = {
+        .count_objects = extent_shrink_count,
+        .scan_objects = extent_shrink_scan,
+        .seeks = DEFAULT_SEEKS,
+};
+
+int ntfs_init_extent_cache(void)
+{
+        return register_shrinker(&extent_shrinker);
+}
+
+void ntfs_destroy_extent_cache(void)
+{
+        unregister_shrinker(&extent_shrinker);
+}
+
 /* Find a sector in allocation tree */
 
 secno ntfs_bplus_lookup(struct super_block *s, struct inode *inode,
@@ -56,10 +227,10 @@ secno ntfs_bplus_lookup(struct super_block *s, struct inode *inode,
                                 return -1;
                         }
                         if (inode) {
-                                struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
-                                ntfs_inode->i_file_sec = le32_to_cpu(btree->u.external[i].file_secno);
-                                ntfs_inode->i_disk_sec = le32_to_cpu(btree->u.external[i].disk_secno);
-                                ntfs_inode->i_n_secs = le32_to_cpu(btree->u.external[i].length);
+                                cache_leaf(inode, btree);
+                                ntfs_set_extent(inode, le32_to_cpu(btree->u.external[i].file_secno),
+                                                le32_to_cpu(btree->u.external[i].disk_secno),
+                                                le32_to_cpu(btree->u.external[i].length));
                         }
                         brelse(bh);
                         return a;
@@ -69,9 +240,52 @@ secno ntfs_bplus_lookup(struct super_block *s, struct inode *inode,
         return -1;
 }
 
-/* Add a sector to tree */
+/*
+ * Copy the extents of the leaf that holds sector sec to ext, starting with
+ * the first one that ends after sec. ext must have room for a full anode.
+ * Returns the number copied, or -1 on error.
+ */
 
-secno ntfs_add_sector_to_btree(struct super_block *s, secno node, int fnod, unsigned fsecno)
+int ntfs_bplus_leaf(struct super_block *s, struct bplus_header *btree,
+                    unsigned sec, struct buffer_head *bh, struct ntfs_extent *ext)
+{
+        anode_secno a = -1;
+        struct anode *anode;
+        int i, n = 0;
+        int c1, c2 = 0;
+        go_down:
+        if (ntfs_sb(s)->sb_chk) if (ntfs_stop_cycles(s, a, &c1, &c2, "ntfs_bplus_leaf")) return -1;
+        if (bp_internal(btree)) {
+                for (i = 0; i < btree->n_used_nodes; i++)
+                        if (le32_to_cpu(btree->u.internal[i].file_secno) > sec) {
+                                a = le32_to_cpu(btree->u.internal[i].down);
+                                brelse(bh);
+                                if (!(anode = ntfs_map_anode(s, a, &bh))) return -1;
+                                btree = &anode->btree;
+                                goto go_down;
+                        }
+                ntfs_error(s, "sector %08x not found in internal anode %08x", sec, a);
+                brelse(bh);
+                return -1;
+        }
+        for (i = 0; i < btree->n_used_nodes; i++)
+                if (le32_to_cpu(btree->u.external[i].file_secno) + le32_to_cpu(btree->u.external[i].length) > sec) {
+                        ext[n].file_sec = le32_to_cpu(btree->u.external[i].file_secno);
+                        ext[n].disk_sec = le32_to_cpu(btree->u.external[i].disk_secno);
+                        ext[n].len = le32_to_cpu(btree->u.external[i].length);
+                        n++;
+                }
+        brelse(bh);
+        return n;
+}
+
+/*
+ * Add up to *n sectors to the end of the tree, as one extent. Returns the
+ * first disk sector added and the number of sectors actually added in *n.
+ * If inode is given, its preallocation window is used and refilled.
+ */
+
+secno ntfs_add_sectors_to_btree(struct super_block *s, struct inode *inode, secno node, int fnod, unsigned fsecno, unsigned *n_secs)
 {
         struct bplus_header *btree;
         struct anode *anode = NULL, *ranode = NULL;
@@ -80,8 +294,11 @@ secno ntfs_add_sector_to_btree(struct super_block *s, secno node, int fnod, unsi
         secno se;
         struct buffer_head *bh, *bh1, *bh2;
         int n;
-        unsigned fs;
+        unsigned fs, want, got;
+        unsigned fwd = fsecno*ALLOC_M>ALLOC_FWD_MAX ? ALLOC_FWD_MAX : fsecno*ALLOC_M<ALLOC_FWD_MIN ? ALLOC_FWD_MIN : fsecno*ALLOC_M;
         int c1, c2 = 0;
+        if (!*n_secs) return -1;
+        if (fnod && inode) ntfs_i(inode)->i_fnode_ok = 0;
         if (fnod) {
                 if (!(fnode = ntfs_map_fnode(s, node, &bh))) return -1;
                 btree = &fnode->btree;
@@ -115,10 +332,15 @@ secno ntfs_add_sector_to_btree(struct super_block *s, secno node, int fnod, unsi
                         brelse(bh);
                         return -1;
                 }
-                if (ntfs_alloc_if_possible(s, se = le32_to_cpu(btree->u.external[n].disk_secno) + le32_to_cpu(btree->u.external[n].length))) {
-                        le32_add_cpu(&btree->u.external[n].length, 1);
+                se = le32_to_cpu(btree->u.external[n].disk_secno) + le32_to_cpu(btree->u.external[n].length);
+                if (!inode || !(got = ntfs_alloc_from_window(inode, se, *n_secs)))
+                        got = ntfs_alloc_run_at(s, se, *n_secs);
+                if (got) {
+                        le32_add_cpu(&btree->u.external[n].length, got);
                         mark_buffer_dirty(bh);
                         brelse(bh);
+                        if (inode) ntfs_prealloc_window(inode, se + got, fwd);
+                        *n_secs = got;
                         return se;
                 }
         } else {
@@ -127,18 +349,34 @@ secno ntfs_add_sector_to_btree(struct super_block *s, secno node, int fnod, unsi
                         brelse(bh);
                         return -1;
                 }
-                se = !fnod ? node : (node + 16384) & ~16383;
+                se = node;
         }
-        if (!(se = ntfs_alloc_sector(s, se, 1, fsecno*ALLOC_M>ALLOC_FWD_MAX ? ALLOC_FWD_MAX : fsecno*ALLOC_M<ALLOC_FWD_MIN ? ALLOC_FWD_MIN : fsecno*ALLOC_M))) {
-                brelse(bh);
-                return -1;
+        if (inode) ntfs_release_window(inode);
+        if (*n_secs == 1) {
+                if (!(se = ntfs_alloc_sector(s, se, 1, fwd))) {
+                        brelse(bh);
+                        return -1;
+                }
+        } else {
+                /* Try the whole run first, then settle for smaller pieces */
+                secno near = se;
+                want = min(*n_secs, 0x4000U);
+                while (!(se = ntfs_alloc_extent(s, near, want, *n_secs, &got))) {
+                        if (want == 1) {
+                                brelse(bh);
+                                return -1;
+                        }
+                        want /= 2;
+                }
+                *n_secs = got;
         }
+        if (inode) ntfs_prealloc_window(inode, se + *n_secs, fwd);
         fs = n < 0 ? 0 : le32_to_cpu(btree->u.external[n].file_secno) + le32_to_cpu(btree->u.external[n].length);
         if (!btree->n_free_nodes) {
                 up = a != node ? le32_to_cpu(anode->up) : -1;
                 if (!(anode = ntfs_alloc_anode(s, a, &na, &bh1))) {
                         brelse(bh);
-                        ntfs_free_sectors(s, se, 1);
+                        ntfs_free_sectors(s, se, *n_secs);
                         return -1;
                 }
                 if (a == node && fnod) {
@@ -155,10 +393,10 @@ secno ntfs_add_sector_to_btree(struct super_block *s, secno node, int fnod, unsi
                         btree->u.internal[0].file_secno = cpu_to_le32(-1);
                         btree->u.internal[0].down = cpu_to_le32(na);
                         mark_buffer_dirty(bh);
-                } else if (!(ranode = ntfs_alloc_anode(s, /*a*/0, &ra, &bh2))) {
+                } else if (!(ranode = ntfs_alloc_anode(s, node, &ra, &bh2))) {
                         brelse(bh);
                         brelse(bh1);
-                        ntfs_free_sectors(s, se, 1);
+                        ntfs_free_sectors(s, se, *n_secs);
                         ntfs_free_sectors(s, na, 1);
                         return -1;
                 }
@@ -170,7 +408,7 @@ secno ntfs_add_sector_to_btree(struct super_block *s, secno node, int fnod, unsi
         le16_add_cpu(&btree->first_free, 12);
         btree->u.external[n].disk_secno = cpu_to_le32(se);
         btree->u.external[n].file_secno = cpu_to_le32(fs);
-        btree->u.external[n].length = cpu_to_le32(1);
+        btree->u.external[n].length = cpu_to_le32(*n_secs);
         mark_buffer_dirty(bh);
         brelse(bh);
         if ((a == node && fnod) || na == -1) return se;
@@ -279,6 +517,14 @@ secno ntfs_add_sector_to_btree(struct super_block *s, secno node, int fnod, unsi
         return se;
 }
 
+/* Add a sector to tree */
+
+secno ntfs_add_sector_to_btree(struct super_block *s, secno node, int fnod, unsigned fsecno)
+{
+        unsigned n = 1;
+        return ntfs_add_sectors_to_btree(s, NULL, node, fnod, fsecno, &n);
+}
+
 /*
  * Remove allocation tree. Recursion would look much nicer but
  * I want to avoid it because it can cause stack overflow.
@@ -308,8 +554,7 @@ void ntfs_remove_btree(struct super_block *s, struct bplus_header *btree)
                 level++;
                 pos = 0;
         }
-        for (i = 0; i < btree1->n_used_nodes; i++)
-                ntfs_free_sectors(s, le32_to_cpu(btree1->u.external[i].disk_secno), le32_to_cpu(btree1->u.external[i].length));
+        ntfs_free_extents(s, btree1->u.external, btree1->n_used_nodes);
         go_up:
         if (!level) return;
         brelse(bh);
@@ -479,8 +724,8 @@ void ntfs_truncate_btree(struct super_block *s, secno f, int fno, unsigned secs)
                         - secs + le32_to_cpu(btree->u.external[i].file_secno)); /* I hope gcc optimizes this :-) */
                 btree->u.external[i].length = cpu_to_le32(secs - le32_to_cpu(btree->u.external[i].file_secno));
         }
-        for (j = i + 1; j < btree->n_used_nodes; j++)
-                ntfs_free_sectors(s, le32_to_cpu(btree->u.external[j].disk_secno), le32_to_cpu(btree->u.external[j].length));
+        if (i + 1 < btree->n_used_nodes)
+                ntfs_free_extents(s, &btree->u.external[i + 1], btree->n_used_nodes - i - 1);
         btree->n_used_nodes = i + 1;
         btree->n_free_nodes = nodes - btree->n_used_nodes;
         btree->first_free = cpu_to_le16(8 + 12 * btree->n_used_nodes);
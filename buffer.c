@@ -22,21 +22,25 @@
 #include <linux/sched.h>
 #include <linux/slab.h>
 #include <linux/blkdev.h>
+#include <linux/mempool.h>
+#include <linux/seq_file.h>
+#include <linux/proc_fs.h>
 #include "ntfs_fn.h"
 
-void ntfs_prefetch_sectors(struct super_block *s, unsigned secno, int n)
+int ntfs_prefetch_sectors(struct super_block *s, unsigned secno, int n)
 {
         struct buffer_head *bh;
         struct blk_plug plug;
+        int submitted = 0;
 
         if (n <= 0 || unlikely(secno >= ntfs_sb(s)->sb_fs_size))
-                return;
+                return 0;
 
         bh = sb_find_get_block(s, secno);
         if (bh) {
                 if (buffer_uptodate(bh)) {
                         brelse(bh);
-                        return;
+                        return 0;
                 }
                 brelse(bh);
         };
@@ -45,13 +49,149 @@ void ntfs_prefetch_sectors(struct super_block *s, unsigned secno, int n)
         while (n > 0) {
                 if (unlikely(secno >= ntfs_sb(s)->sb_fs_size))
                         break;
-                sb_breadahead(s, secno);
+                /* Like sb_breadahead, but count what is really read */
+                if ((bh = sb_getblk(s, secno))) {
+                        if (!buffer_uptodate(bh) && !buffer_locked(bh)) {
+                                ll_rw_block(READA, 1, &bh);
+                                submitted++;
+                        }
+                        brelse(bh);
+                }
                 secno++;
                 n--;
         }
         blk_finish_plug(&plug);
+        return submitted;
+}
+
+/*
+ * Adaptive metadata readahead. An access inside the last window counts
+ * the units it uses for the first time as hits; once half of the window
+ * is used, it is doubled and extended. An access right behind the window
+ * is sequential too and grows it. Any other access starts a new window,
+ * halved if less than half as many units as its size were used beyond
+ * the demand read, so random lookups end up reading nothing ahead.
+ * Only units actually submitted are counted as issued, and only as many
+ * hits are credited as were submitted in the window.
+ */
+
+static const struct {
+        const char *name;
+        unsigned size, min, max;
+} ra_classes[NTFS_RA_CLASSES] = {
+        [NTFS_RA_FNODE] = { "fnode", 16, 0, 64 },
+        [NTFS_RA_ANODE] = { "anode", 0, 0, 32 },
+        [NTFS_RA_DNODE] = { "dnode", 72, 0, 256 },
+        [NTFS_RA_BITMAP] = { "bitmap", 1, 0, 16 },
+};
+
+void ntfs_init_readahead(struct super_block *s)
+{
+        int c;
+        for (c = 0; c < NTFS_RA_CLASSES; c++) {
+                struct ntfs_ra *ra = &ntfs_sb(s)->sb_ra[c];
+                memset(ra, 0, sizeof(struct ntfs_ra));
+                ra->size = ra_classes[c].size;
+                ra->min = ra_classes[c].min;
+                ra->max = ra_classes[c].max;
+        }
+}
+
+static void ra_grow(struct ntfs_ra *ra)
+{
+        ra->size = ra->size ? ra->size * 2 : 4;
+        if (ra->size > ra->max) ra->size = ra->max;
+}
+
+/*
+ * Account an access to units pos .. pos+n-1 of a class. Returns where to
+ * read ahead from and sets *len to how many units, 0 for nothing.
+ */
+
+unsigned ntfs_ra_window(struct super_block *s, int class, unsigned pos, unsigned n,
+                        unsigned *len)
+{
+        struct ntfs_ra *ra = &ntfs_sb(s)->sb_ra[class];
+        unsigned from;
+        *len = 0;
+        if (pos >= ra->start && pos < ra->end) {
+                if (pos + n > ra->next) {
+                        unsigned h = min(pos + n, ra->end) - max(pos, ra->next);
+                        h = min(h, ra->unused);
+                        ra->hits += h;
+                        ra->unused -= h;
+                        ra->next = pos + n;
+                }
+                if (ra->next < ra->end && ra->end - ra->next > ra->size / 2)
+                        return 0;
+                ra_grow(ra);
+                from = max(ra->end, pos + n);
+        } else {
+                /* Only the units read ahead count, not the demand read */
+                unsigned used = ra->next - ra->start > n ? ra->next - ra->start - n : 0;
+                if (pos == ra->end && pos)
+                        ra_grow(ra);
+                else if (ra->end && used * 2 < ra->size) {
+                        ra->size /= 2;
+                        if (ra->size < ra->min) ra->size = ra->min;
+                }
+                ra->start = pos;
+                ra->next = from = pos + n;
+                ra->unused = 0;
+        }
+        ra->end = from + ra->size;
+        *len = ra->size;
+        return from;
+}
+
+/* Account n units of a class that were really submitted for readahead */
+
+void ntfs_ra_issued(struct super_block *s, int class, unsigned n)
+{
+        struct ntfs_ra *ra = &ntfs_sb(s)->sb_ra[class];
+        ra->issued += n;
+        ra->unused += n;
+}
+
+/* Read ahead for a metadata access to sectors secno .. secno+n-1 */
+
+void ntfs_readahead(struct super_block *s, int class, unsigned secno, unsigned n)
+{
+        unsigned len;
+        unsigned from = ntfs_ra_window(s, class, secno, n, &len);
+        ntfs_ra_issued(s, class, ntfs_prefetch_sectors(s, from, len));
+}
+
+static int ra_proc_show(struct seq_file *m, void *v)
+{
+        struct super_block *s = m->private;
+        int c;
+        seq_printf(m, "%-8s %8s %12s %12s %6s\n", "class", "window", "issued", "hits", "ratio");
+        /* A racy snapshot is good enough, don't wait for ntfs_lock */
+        for (c = 0; c < NTFS_RA_CLASSES; c++) {
+                struct ntfs_ra *ra = &ntfs_sb(s)->sb_ra[c];
+                unsigned long issued = ACCESS_ONCE(ra->issued);
+                unsigned long hits = ACCESS_ONCE(ra->hits);
+                seq_printf(m, "%-8s %8u %12lu %12lu %5lu%%\n", ra_classes[c].name,
+                           ACCESS_ONCE(ra->size), issued, hits,
+                           issued ? min(hits, issued) * 100 / issued : 0);
+        }
+        return 0;
 }
 
+static int ra_proc_open(struct inode *inode, struct file *file)
+{
+        return single_open(file, ra_proc_show, PDE_DATA(inode));
+}
+
+const struct file_operations ntfs_ra_proc_fops = {
+        .owner          = THIS_MODULE,
+        .open           = ra_proc_open,
+        .read           = seq_read,
+        .llseek         = seq_lseek,
+        .release        = single_release,
+};
+
 /* Map a sector into a buffer and return pointers to it and to the buffer. */
 
 void *ntfs_map_sector(struct super_block *s, unsigned secno, struct buffer_head **bhp,
@@ -88,6 +228,8 @@ void *ntfs_get_sector(struct super_block *s, unsigned secno, struct buffer_head
         if ((*bhp = bh = sb_getblk(s, secno)) != NULL) {
                 if (!buffer_uptodate(bh)) wait_on_buffer(bh);
                 set_buffer_uptodate(bh);
+                /* New contents, an fnode here must be checked again */
+                clear_buffer_fnode_checked(bh);
                 return bh->b_data;
         } else {
                 printk("NTFS: ntfs_get_sector: getblk failed\n");
@@ -95,63 +237,210 @@ void *ntfs_get_sector(struct super_block *s, unsigned secno, struct buffer_head
         }
 }
 
-/* Map 4 sectors into a 4buffer and return pointers to it and to the buffer. */
+/*
+ * Fixed size scratch buffers: 2k blocks of 4buffers that can't be used in
+ * place, 256-byte names and 0x924-byte dnodes for splitting. The split
+ * buffers come from a mempool, a split must not fail half way.
+ */
+
+static struct kmem_cache *ntfs_qbh_cachep;
+static struct kmem_cache *ntfs_name_cachep;
+static struct kmem_cache *ntfs_split_cachep;
+static mempool_t *ntfs_split_pool;
+
+int ntfs_init_buffer_caches(void)
+{
+        if (!(ntfs_qbh_cachep = kmem_cache_create("ntfs_qbh_cache", 2048, 0, 0, NULL)))
+                goto bail;
+        if (!(ntfs_name_cachep = kmem_cache_create("ntfs_name_cache", 256, 0, 0, NULL)))
+                goto bail1;
+        if (!(ntfs_split_cachep = kmem_cache_create("ntfs_split_cache", 0x924, 0, 0, NULL)))
+                goto bail2;
+        if (!(ntfs_split_pool = mempool_create_slab_pool(1, ntfs_split_cachep)))
+                goto bail3;
+        return 0;
+
+        bail3:
+        kmem_cache_destroy(ntfs_split_cachep);
+        bail2:
+        kmem_cache_destroy(ntfs_name_cachep);
+        bail1:
+        kmem_cache_destroy(ntfs_qbh_cachep);
+        bail:
+        return -ENOMEM;
+}
+
+void ntfs_destroy_buffer_caches(void)
+{
+        mempool_destroy(ntfs_split_pool);
+        kmem_cache_destroy(ntfs_split_cachep);
+        kmem_cache_destroy(ntfs_name_cachep);
+        kmem_cache_destroy(ntfs_qbh_cachep);
+}
+
+unsigned char *ntfs_alloc_name(gfp_t gfp)
+{
+        return kmem_cache_alloc(ntfs_name_cachep, gfp);
+}
+
+void ntfs_free_name(unsigned char *name)
+{
+        if (name) kmem_cache_free(ntfs_name_cachep, name);
+}
+
+/* Sleeps until a buffer is available, never fails */
+
+struct dnode *ntfs_alloc_split_dnode(void)
+{
+        return mempool_alloc(ntfs_split_pool, GFP_NOFS);
+}
+
+void ntfs_free_split_dnode(struct dnode *d)
+{
+        if (d) mempool_free(d, ntfs_split_pool);
+}
+
+/*
+ * Get the 2k block of a 4buffer whose buffers are read. If the four
+ * buffers lie one after another in memory, which they do when they are in
+ * the same page of the block device, the block is used in place.
+ * Otherwise it's copied into a buffer from ntfs_qbh_cachep and copied back when
+ * marked dirty.
+ */
+
+static void *qbh_data(struct quad_buffer_head *qbh)
+{
+        char *data = qbh->bh[0]->b_data;
+        int i;
+        for (i = 1; i < 4; i++)
+                if (qbh->bh[i]->b_data != data + i * 512) goto copy;
+        return qbh->data = data;
+        copy:
+        if (!(qbh->data = data = kmem_cache_alloc(ntfs_qbh_cachep, GFP_NOFS)))
+                return NULL;
+        for (i = 0; i < 4; i++)
+                memcpy(data + i * 512, qbh->bh[i]->b_data, 512);
+        return data;
+}
+
+static inline int qbh_copied(struct quad_buffer_head *qbh)
+{
+        return qbh->data != qbh->bh[0]->b_data;
+}
+
+static void end_quad_read(struct bio *bio, int err)
+{
+        struct buffer_head *bh = bio->bi_private, *next;
+        int i;
+        for (i = 0; i < 4; i++, bh = next) {
+                next = bh->b_this_page;
+                if (!err) set_buffer_uptodate(bh);
+                else clear_buffer_uptodate(bh);
+                unlock_buffer(bh);
+        }
+        bio_put(bio);
+}
+
+/*
+ * Read a 2k block with a single bio. This is possible when its four
+ * buffers lie one after another in a page and none of them is uptodate
+ * (an uptodate one could be dirty). Returns 0 if the buffers were left
+ * alone.
+ */
+
+static int read_quad(struct super_block *s, unsigned secno, struct buffer_head **bh)
+{
+        struct bio *bio;
+        int i;
+        for (i = 1; i < 4; i++)
+                if (bh[i - 1]->b_this_page != bh[i] ||
+                    bh[i]->b_data != bh[0]->b_data + i * 512) return 0;
+        for (i = 0; i < 4; i++) {
+                if (!trylock_buffer(bh[i])) goto unlock;
+                if (buffer_uptodate(bh[i])) {
+                        unlock_buffer(bh[i]);
+                        goto unlock;
+                }
+        }
+        bio = bio_alloc(GFP_NOIO, 1);
+        bio->bi_iter.bi_sector = secno;
+        bio->bi_bdev = s->s_bdev;
+        bio_add_page(bio, bh[0]->b_page, 2048, bh_offset(bh[0]));
+        bio->bi_private = bh[0];
+        bio->bi_end_io = end_quad_read;
+        submit_bio(READ | REQ_META, bio);
+        return 1;
+
+        unlock:
+        while (i--)
+                unlock_buffer(bh[i]);
+        return 0;
+}
+
+/*
+ * Map 4 sectors into a 4buffer and return pointers to it and to the buffer.
+ * If ahead is given, the block and *ahead sectors behind it are submitted
+ * together and waited for once; *ahead is set to how many of those were
+ * actually read.
+ */
 
 void *ntfs_map_4sectors(struct super_block *s, unsigned secno, struct quad_buffer_head *qbh,
-                   int ahead)
+                   unsigned *ahead)
 {
-        struct buffer_head *bh;
-        char *data;
+        struct blk_plug plug;
+        void *data;
+        unsigned n_ahead = 0;
+        int i;
 
         ntfs_lock_assert(s);
 
         cond_resched();
 
+        if (ahead) {
+                n_ahead = *ahead;
+                *ahead = 0;
+        }
+
         if (secno & 3) {
                 printk("NTFS: ntfs_map_4sectors: unaligned read\n");
                 return NULL;
         }
 
-        ntfs_prefetch_sectors(s, secno, 4 + ahead);
+        for (i = 0; i < 4; i++)
+                if (!(qbh->bh[i] = sb_getblk(s, secno + i))) {
+                        printk("NTFS: ntfs_map_4sectors: getblk failed\n");
+                        goto bail;
+                }
 
-        qbh->data = data = kmalloc(2048, GFP_NOFS);
-        if (!data) {
+        blk_start_plug(&plug);
+        if (!read_quad(s, secno, qbh->bh))
+                ll_rw_block(READ | REQ_META, 4, qbh->bh);
+        if (ahead) *ahead = ntfs_prefetch_sectors(s, secno + 4, n_ahead);
+        blk_finish_plug(&plug);
+
+        for (i = 0; i < 4; i++) {
+                wait_on_buffer(qbh->bh[i]);
+                if (buffer_uptodate(qbh->bh[i])) continue;
+                /* It was locked by someone else who didn't read it */
+                ll_rw_block(READ | REQ_META, 1, &qbh->bh[i]);
+                wait_on_buffer(qbh->bh[i]);
+                if (!buffer_uptodate(qbh->bh[i])) {
+                        printk("NTFS: ntfs_map_4sectors: read error\n");
+                        i = 4;
+                        goto bail;
+                }
+        }
+
+        if (!(data = qbh_data(qbh))) {
                 printk("NTFS: ntfs_map_4sectors: out of memory\n");
+                i = 4;
                 goto bail;
         }
-
-        qbh->bh[0] = bh = sb_bread(s, secno);
-        if (!bh)
-                goto bail0;
-        memcpy(data, bh->b_data, 512);
-
-        qbh->bh[1] = bh = sb_bread(s, secno + 1);
-        if (!bh)
-                goto bail1;
-        memcpy(data + 512, bh->b_data, 512);
-
-        qbh->bh[2] = bh = sb_bread(s, secno + 2);
-        if (!bh)
-                goto bail2;
-        memcpy(data + 2 * 512, bh->b_data, 512);
-
-        qbh->bh[3] = bh = sb_bread(s, secno + 3);
-        if (!bh)
-                goto bail3;
-        memcpy(data + 3 * 512, bh->b_data, 512);
-
         return data;
 
- bail3:
-        brelse(qbh->bh[2]);
- bail2:
-        brelse(qbh->bh[1]);
- bail1:
-        brelse(qbh->bh[0]);
- bail0:
-        kfree(data);
-        printk("NTFS: ntfs_map_4sectors: read error\n");
  bail:
+        while (i--)
+                brelse(qbh->bh[i]);
         return NULL;
 }
 
@@ -160,6 +449,9 @@ void *ntfs_map_4sectors(struct super_block *s, unsigned secno, struct quad_buffe
 void *ntfs_get_4sectors(struct super_block *s, unsigned secno,
                           struct quad_buffer_head *qbh)
 {
+        void *data;
+        int i;
+
         cond_resched();
 
         ntfs_lock_assert(s);
@@ -169,46 +461,78 @@ void *ntfs_get_4sectors(struct super_block *s, unsigned secno,
                 return NULL;
         }
 
-        /*return ntfs_map_4sectors(s, secno, qbh, 0);*/
-        if (!(qbh->data = kmalloc(2048, GFP_NOFS))) {
+        /*return ntfs_map_4sectors(s, secno, qbh, NULL);*/
+        for (i = 0; i < 4; i++)
+                if (!ntfs_get_sector(s, secno + i, &qbh->bh[i])) goto bail;
+        if (!(data = qbh_data(qbh))) {
                 printk("NTFS: ntfs_get_4sectors: out of memory\n");
-                return NULL;
+                goto bail;
         }
-        if (!(ntfs_get_sector(s, secno, &qbh->bh[0]))) goto bail0;
-        if (!(ntfs_get_sector(s, secno + 1, &qbh->bh[1]))) goto bail1;
-        if (!(ntfs_get_sector(s, secno + 2, &qbh->bh[2]))) goto bail2;
-        if (!(ntfs_get_sector(s, secno + 3, &qbh->bh[3]))) goto bail3;
-        memcpy(qbh->data, qbh->bh[0]->b_data, 512);
-        memcpy(qbh->data + 512, qbh->bh[1]->b_data, 512);
-        memcpy(qbh->data + 2*512, qbh->bh[2]->b_data, 512);
-        memcpy(qbh->data + 3*512, qbh->bh[3]->b_data, 512);
-        return qbh->data;
-
-        bail3:  brelse(qbh->bh[2]);
-        bail2:  brelse(qbh->bh[1]);
-        bail1:  brelse(qbh->bh[0]);
-        bail0:
+        return data;
+
+        bail:
+        while (i--)
+                brelse(qbh->bh[i]);
         return NULL;
 }
 
 
 void ntfs_brelse4(struct quad_buffer_head *qbh)
 {
+        if (!qbh->bh[0]) return;        /* resident bitmap */
+        if (qbh_copied(qbh)) kmem_cache_free(ntfs_qbh_cachep, qbh->data);
         brelse(qbh->bh[3]);
         brelse(qbh->bh[2]);
         brelse(qbh->bh[1]);
         brelse(qbh->bh[0]);
-        kfree(qbh->data);
+}
+
+/*
+ * A resident bitmap has no buffers while mapped. Copy the sector if it
+ * differs from the buffer cache and dirty it.
+ */
+
+static void mark_resident_dirty(struct quad_buffer_head *qbh, int i)
+{
+        struct buffer_head *bh;
+        if (!(bh = sb_getblk(qbh->s, qbh->sec + i))) {
+                printk("NTFS: ntfs_mark_4buffers_dirty: getblk failed\n");
+                return;
+        }
+        if (!buffer_uptodate(bh)) wait_on_buffer(bh);
+        if (!buffer_uptodate(bh) || memcmp(bh->b_data, qbh->data + i * 512, 512)) {
+                memcpy(bh->b_data, qbh->data + i * 512, 512);
+                set_buffer_uptodate(bh);
+                mark_buffer_dirty(bh);
+        }
+        brelse(bh);
+}
+
+/*
+ * Mark len bytes at offset off of a 4buffer dirty. Only the sectors they
+ * fall into are written back; a copied sector that didn't change isn't
+ * dirtied at all.
+ */
+
+void ntfs_mark_4buffers_range_dirty(struct quad_buffer_head *qbh, unsigned off, unsigned len)
+{
+        int i;
+        if (!len) return;
+        for (i = off / 512; i <= (off + len - 1) / 512; i++) {
+                if (!qbh->bh[0]) {
+                        mark_resident_dirty(qbh, i);
+                        continue;
+                }
+                if (qbh_copied(qbh)) {
+                        if (!memcmp(qbh->bh[i]->b_data, qbh->data + i * 512, 512))
+                                continue;
+                        memcpy(qbh->bh[i]->b_data, qbh->data + i * 512, 512);
+                }
+                mark_buffer_dirty(qbh->bh[i]);
+        }
 }
 
 void ntfs_mark_4buffers_dirty(struct quad_buffer_head *qbh)
 {
-        memcpy(qbh->bh[0]->b_data, qbh->data, 512);
-        memcpy(qbh->bh[1]->b_data, qbh->data + 512, 512);
-        memcpy(qbh->bh[2]->b_data, qbh->data + 2 * 512, 512);
-        memcpy(qbh->bh[3]->b_data, qbh->data + 3 * 512, 512);
-        mark_buffer_dirty(qbh->bh[0]);
-        mark_buffer_dirty(qbh->bh[1]);
-        mark_buffer_dirty(qbh->bh[2]);
-        mark_buffer_dirty(qbh->bh[3]);
+        ntfs_mark_4buffers_range_dirty(qbh, 0, 2048);
 }
@@ -178,12 +178,12 @@ static int ntfs_readdir(struct file *file, struct dir_context *ctx)
                 }
                 tempname = ntfs_translate_name(inode->i_sb, de->name, de->namelen, lc, de->not_8x3);
                 if (!dir_emit(ctx, tempname, de->namelen, le32_to_cpu(de->fnode), DT_UNKNOWN)) {
-                        if (tempname != de->name) kfree(tempname);
+                        if (tempname != de->name) ntfs_free_name(tempname);
                         ntfs_brelse4(&qbh);
                         goto out;
                 }
                 ctx->pos = next_pos;
-                if (tempname != de->name) kfree(tempname);
+                if (tempname != de->name) ntfs_free_name(tempname);
                 ntfs_brelse4(&qbh);
         }
 out:
@@ -340,4 +340,8 @@ const struct file_operations ntfs_dir_ops =
         .iterate        = ntfs_readdir,
         .release        = ntfs_dir_release,
         .fsync          = ntfs_file_fsync,
+        .unlocked_ioctl = ntfs_ioctl,
+#ifdef CONFIG_COMPAT
+        .compat_ioctl   = ntfs_compat_ioctl,
+#endif
 };
@@ -97,10 +97,10 @@ static void ntfs_pos_subst(loff_t *p, loff_t f, loff_t t)
         if (*p == f) *p = t;
 }
 
-/*void ntfs_ntfs_pos_substd(loff_t *p, loff_t f, loff_t t)
+static void ntfs_pos_substd(loff_t *p, loff_t f, loff_t t)
 {
         if ((*p & ~0x3f) == (f & ~0x3f)) *p = (t & ~0x3f) | (*p & 0x3f);
-}*/
+}
 
 static void ntfs_pos_ins(loff_t *p, loff_t d, loff_t c)
 {
@@ -252,28 +252,28 @@ static int ntfs_add_to_dnode(struct inode *i, dnode_secno dno,
         struct buffer_head *bh;
         struct fnode *fnode;
         int c1, c2 = 0;
-        if (!(nname = kmalloc(256, GFP_NOFS))) {
+        if (!(nname = ntfs_alloc_name(GFP_NOFS))) {
                 printk("NTFS: out of memory, can't add to dnode\n");
                 return 1;
         }
         go_up:
         if (namelen >= 256) {
                 ntfs_error(i->i_sb, "ntfs_add_to_dnode: namelen == %d", namelen);
-                kfree(nd);
-                kfree(nname);
+                ntfs_free_split_dnode(nd);
+                ntfs_free_name(nname);
                 return 1;
         }
         if (!(d = ntfs_map_dnode(i->i_sb, dno, &qbh))) {
-                kfree(nd);
-                kfree(nname);
+                ntfs_free_split_dnode(nd);
+                ntfs_free_name(nname);
                 return 1;
         }
         go_up_a:
         if (ntfs_sb(i->i_sb)->sb_chk)
                 if (ntfs_stop_cycles(i->i_sb, dno, &c1, &c2, "ntfs_add_to_dnode")) {
                         ntfs_brelse4(&qbh);
-                        kfree(nd);
-                        kfree(nname);
+                        ntfs_free_split_dnode(nd);
+                        ntfs_free_name(nname);
                         return 1;
                 }
         if (le32_to_cpu(d->first_free) + de_size(namelen, down_ptr) <= 2048) {
@@ -285,21 +285,16 @@ static int ntfs_add_to_dnode(struct inode *i, dnode_secno dno,
                 for_all_poss(i, ntfs_pos_subst, 5, t + 1);
                 ntfs_mark_4buffers_dirty(&qbh);
                 ntfs_brelse4(&qbh);
-                kfree(nd);
-                kfree(nname);
+                ntfs_free_split_dnode(nd);
+                ntfs_free_name(nname);
                 return 0;
         }
-        if (!nd) if (!(nd = kmalloc(0x924, GFP_NOFS))) {
-                /* 0x924 is a max size of dnode after adding a dirent with
-                   max name length. We alloc this only once. There must
-                   not be any error while splitting dnodes, otherwise the
-                   whole directory, not only file we're adding, would
-                   be lost. */
-                printk("NTFS: out of memory for dnode splitting\n");
-                ntfs_brelse4(&qbh);
-                kfree(nname);
-                return 1;
-        }
+        /* 0x924 is a max size of dnode after adding a dirent with
+           max name length. We alloc this only once. There must
+           not be any error while splitting dnodes, otherwise the
+           whole directory, not only file we're adding, would
+           be lost, so it comes from a mempool. */
+        if (!nd) nd = ntfs_alloc_split_dnode();
         memcpy(nd, d, le32_to_cpu(d->first_free));
         copy_de(de = ntfs_add_de(i->i_sb, nd, name, namelen, down_ptr), new_de);
         for_all_poss(i, ntfs_pos_ins, get_pos(nd, de), 1);
@@ -307,8 +302,8 @@ static int ntfs_add_to_dnode(struct inode *i, dnode_secno dno,
         if (!(ad = ntfs_alloc_dnode(i->i_sb, le32_to_cpu(d->up), &adno, &qbh1))) {
                 ntfs_error(i->i_sb, "unable to alloc dnode - dnode tree will be corrupted");
                 ntfs_brelse4(&qbh);
-                kfree(nd);
-                kfree(nname);
+                ntfs_free_split_dnode(nd);
+                ntfs_free_name(nname);
                 return 1;
         }
         i->i_size += 2048;
@@ -345,8 +340,8 @@ static int ntfs_add_to_dnode(struct inode *i, dnode_secno dno,
                 ntfs_error(i->i_sb, "unable to alloc dnode - dnode tree will be corrupted");
                 ntfs_brelse4(&qbh);
                 ntfs_brelse4(&qbh1);
-                kfree(nd);
-                kfree(nname);
+                ntfs_free_split_dnode(nd);
+                ntfs_free_name(nname);
                 return 1;
         }
         i->i_size += 2048;
@@ -358,8 +353,8 @@ static int ntfs_add_to_dnode(struct inode *i, dnode_secno dno,
                 ntfs_brelse4(&qbh);
                 ntfs_brelse4(&qbh1);
                 ntfs_brelse4(&qbh2);
-                kfree(nd);
-                kfree(nname);
+                ntfs_free_split_dnode(nd);
+                ntfs_free_name(nname);
                 return 1;
         }
         fnode->u.external[0].disk_secno = cpu_to_le32(rdno);
@@ -993,6 +988,124 @@ void ntfs_remove_dtree(struct super_block *s, dnode_secno dno)
         ntfs_error(s, "directory %08x is corrupted or not empty", rdno);
 }
 
+/*
+ * Move a dnode to sector new. The copy is written first, then the pointer
+ * to it from its parent dnode (or the fnode, for the root) is switched,
+ * then the up pointers of its children and readdir positions are fixed.
+ */
+
+static int relocate_dnode(struct inode *i, dnode_secno dno, dnode_secno new)
+{
+        struct super_block *s = i->i_sb;
+        struct quad_buffer_head qbh, nqbh;
+        struct dnode *d, *nd;
+        struct ntfs_dirent *de, *de_end;
+        struct fnode *fnode;
+        struct buffer_head *bh;
+        dnode_secno up;
+        if (!(d = ntfs_map_dnode(s, dno, &qbh))) return -EIO;
+        if (!(nd = ntfs_get_4sectors(s, new, &nqbh))) {
+                ntfs_brelse4(&qbh);
+                return -EIO;
+        }
+        memcpy(nd, d, 2048);
+        ntfs_brelse4(&qbh);
+        nd->self = cpu_to_le32(new);
+        ntfs_mark_4buffers_dirty(&nqbh);
+        up = le32_to_cpu(nd->up);
+        if (nd->root_dnode) {
+                if (!(fnode = ntfs_map_fnode(s, up, &bh))) goto fail;
+                fnode->u.external[0].disk_secno = cpu_to_le32(new);
+                mark_buffer_dirty(bh);
+                brelse(bh);
+                ntfs_i(i)->i_dno = new;
+        } else {
+                if (!(d = ntfs_map_dnode(s, up, &qbh))) goto fail;
+                de_end = dnode_end_de(d);
+                for (de = dnode_first_de(d); de < de_end; de = de_next_de(de))
+                        if (de->down && de_down_pointer(de) == dno) goto found;
+                ntfs_error(s, "relocate_dnode: pointer to dnode %08x not found in dnode %08x", dno, up);
+                ntfs_brelse4(&qbh);
+                goto fail;
+                found:
+                *(__le32 *)((char *)de + le16_to_cpu(de->length) - 4) = cpu_to_le32(new);
+                ntfs_mark_4buffers_dirty(&qbh);
+                ntfs_brelse4(&qbh);
+        }
+        fix_up_ptrs(s, nd);
+        ntfs_brelse4(&nqbh);
+        for_all_poss(i, ntfs_pos_substd, (loff_t)dno << 4, (loff_t)new << 4);
+        ntfs_free_dnode(s, dno);
+        return 0;
+        fail:
+        ntfs_brelse4(&nqbh);
+        return -EIO;
+}
+
+/*
+ * Move the dnodes of a directory that lie outside the directory band into
+ * it, while it has free dnodes to spare.
+ */
+
+int ntfs_defrag_dtree(struct inode *i)
+{
+        struct super_block *s = i->i_sb;
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        struct quad_buffer_head qbh;
+        struct dnode *d;
+        struct ntfs_dirent *de, *de_end;
+        dnode_secno *list;
+        dnode_secno new;
+        secno near = i->i_ino;
+        int max, n, k;
+        int r = 0;
+        mutex_lock(&i->i_mutex);
+        ntfs_lock(s);
+        max = (i->i_size >> 11) + 1;
+        if (!(list = kmalloc(max * sizeof(dnode_secno), GFP_NOFS))) {
+                r = -ENOMEM;
+                goto unlock;
+        }
+        /* Collect the dnodes first, relocating them changes the tree */
+        list[0] = ntfs_i(i)->i_dno;
+        n = 1;
+        for (k = 0; k < n; k++) {
+                if (!(d = ntfs_map_dnode(s, list[k], &qbh))) {
+                        r = -EIO;
+                        goto free;
+                }
+                de_end = dnode_end_de(d);
+                for (de = dnode_first_de(d); de < de_end; de = de_next_de(de))
+                        if (de->down) {
+                                if (n == max) {
+                                        ntfs_error(s, "directory %08lx has more dnodes than expected", i->i_ino);
+                                        ntfs_brelse4(&qbh);
+                                        r = -EIO;
+                                        goto free;
+                                }
+                                list[n++] = de_down_pointer(de);
+                        }
+                ntfs_brelse4(&qbh);
+        }
+        for (k = 0; k < n; k++) {
+                if (list[k] >= sbi->sb_dirband_start &&
+                    list[k] < sbi->sb_dirband_start + sbi->sb_dirband_size) continue;
+                if (sbi->sb_n_free_dnodes <= FREE_DNODES_ADD) break;
+                if (!(new = ntfs_alloc_in_dirband(s, near))) break;
+                if ((r = relocate_dnode(i, list[k], new))) {
+                        ntfs_free_dnode(s, new);
+                        break;
+                }
+                near = new;
+        }
+        free:
+        kfree(list);
+        unlock:
+        ntfs_unlock(s);
+        mutex_unlock(&i->i_mutex);
+        return r;
+}
+
 /*
  * Find dirent for specified fnode. Use truncated 15-char name in fnode as
  * a help for searching.
@@ -1013,7 +1126,7 @@ struct ntfs_dirent *map_fnode_dirent(struct super_block *s, fnode_secno fno,
         int c1, c2 = 0;
         int d1, d2 = 0;
         name1 = f->name;
-        if (!(name2 = kmalloc(256, GFP_NOFS))) {
+        if (!(name2 = ntfs_alloc_name(GFP_NOFS))) {
                 printk("NTFS: out of memory, can't map dirent\n");
                 return NULL;
         }
@@ -1026,13 +1139,13 @@ struct ntfs_dirent *map_fnode_dirent(struct super_block *s, fnode_secno fno,
                 name1len = 15; name2len = 256;
         }
         if (!(upf = ntfs_map_fnode(s, le32_to_cpu(f->up), &bh))) {
-                kfree(name2);
+                ntfs_free_name(name2);
                 return NULL;
         }
         if (!fnode_is_dir(upf)) {
                 brelse(bh);
                 ntfs_error(s, "fnode %08x has non-directory parent %08x", fno, le32_to_cpu(f->up));
-                kfree(name2);
+                ntfs_free_name(name2);
                 return NULL;
         }
         dno = le32_to_cpu(upf->u.external[0].disk_secno);
@@ -1041,7 +1154,7 @@ struct ntfs_dirent *map_fnode_dirent(struct super_block *s, fnode_secno fno,
         downd = 0;
         go_up:
         if (!(d = ntfs_map_dnode(s, dno, qbh))) {
-                kfree(name2);
+                ntfs_free_name(name2);
                 return NULL;
         }
         de_end = dnode_end_de(d);
@@ -1053,12 +1166,12 @@ struct ntfs_dirent *map_fnode_dirent(struct super_block *s, fnode_secno fno,
                 }
                 ntfs_error(s, "pointer to dnode %08x not found in dnode %08x", downd, dno);
                 ntfs_brelse4(qbh);
-                kfree(name2);
+                ntfs_free_name(name2);
                 return NULL;
         }
         next_de:
         if (le32_to_cpu(de->fnode) == fno) {
-                kfree(name2);
+                ntfs_free_name(name2);
                 return de;
         }
         c = ntfs_compare_names(s, name1, name1len, de->name, de->namelen, de->last);
@@ -1067,14 +1180,14 @@ struct ntfs_dirent *map_fnode_dirent(struct super_block *s, fnode_secno fno,
                 ntfs_brelse4(qbh);
                 if (ntfs_sb(s)->sb_chk)
                         if (ntfs_stop_cycles(s, dno, &c1, &c2, "map_fnode_dirent #1")) {
-                        kfree(name2);
+                        ntfs_free_name(name2);
                         return NULL;
                 }
                 goto go_down;
         }
         f:
         if (le32_to_cpu(de->fnode) == fno) {
-                kfree(name2);
+                ntfs_free_name(name2);
                 return de;
         }
         c = ntfs_compare_names(s, name2, name2len, de->name, de->namelen, de->last);
@@ -1086,13 +1199,13 @@ struct ntfs_dirent *map_fnode_dirent(struct super_block *s, fnode_secno fno,
         ntfs_brelse4(qbh);
         if (ntfs_sb(s)->sb_chk)
                 if (ntfs_stop_cycles(s, downd, &d1, &d2, "map_fnode_dirent #2")) {
-                        kfree(name2);
+                        ntfs_free_name(name2);
                         return NULL;
                 }
         goto go_up;
         not_found:
         ntfs_brelse4(qbh);
         ntfs_error(s, "dirent for fnode %08x not found", fno);
-        kfree(name2);
+        ntfs_free_name(name2);
         return NULL;
 }
@@ -297,15 +297,16 @@ void ntfs_set_ea(struct inode *inode, struct fnode *fnode, const char *key,
         len = (le32_to_cpu(fnode->ea_size_l) + 511) >> 9;
         if (pos >= 30000) goto bail;
         while (((pos + 511) >> 9) > len) {
+                unsigned got;
                 if (!len) {
-                        secno q = ntfs_alloc_sector(s, fno, 1, 0);
+                        secno q = ntfs_alloc_extent(s, fno, 1, (pos + 511) >> 9, &got);
                         if (!q) goto bail;
                         fnode->ea_secno = cpu_to_le32(q);
                         fnode->flags &= ~FNODE_anode;
-                        len++;
+                        len += got;
                 } else if (!fnode_in_anode(fnode)) {
-                        if (ntfs_alloc_if_possible(s, le32_to_cpu(fnode->ea_secno) + len)) {
-                                len++;
+                        if ((got = ntfs_alloc_run_at(s, le32_to_cpu(fnode->ea_secno) + len, ((pos + 511) >> 9) - len))) {
+                                len += got;
                         } else {
                                 /* Aargh... don't know how to create ea anodes :-( */
                                 /*struct buffer_head *bh;
@@ -327,7 +328,7 @@ void ntfs_set_ea(struct inode *inode, struct fnode *fnode, const char *key,
                                 fnode->ea_secno = cpu_to_le32(a_s);*/
                                 secno new_sec;
                                 int i;
-                                if (!(new_sec = ntfs_alloc_sector(s, fno, 1, 1 - ((pos + 511) >> 9))))
+                                if (!(new_sec = ntfs_alloc_extent(s, fno, (pos + 511) >> 9, (pos + 511) >> 9, &got)))
                                         goto bail;
                                 for (i = 0; i < len; i++) {
                                         struct buffer_head *bh1, *bh2;
@@ -21,6 +21,9 @@
 
 #include "ntfs_fn.h"
 #include <linux/mpage.h>
+#include <linux/blkdev.h>
+#include <linux/uaccess.h>
+#include <linux/compat.h>
 
 #define BLOCKS(size) (((size) + 511) >> 9)
 
@@ -28,6 +31,7 @@ static int ntfs_file_release(struct inode *inode, struct file *file)
 {
         ntfs_lock(inode->i_sb);
         ntfs_write_if_changed(inode);
+        ntfs_release_window(inode);
         ntfs_unlock(inode->i_sb);
         return 0;
 }
@@ -48,20 +52,36 @@ int ntfs_file_fsync(struct file *file, loff_t start, loff_t end, int datasync)
  * so we must ignore such errors.
  */
 
-static secno ntfs_bmap(struct inode *inode, unsigned file_secno, unsigned *n_secs)
+/* Look a sector up in the allocation tree, starting at the cached root */
+
+static secno lookup_sector(struct inode *inode, unsigned file_secno)
 {
         struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
-        unsigned n, disk_secno;
         struct fnode *fnode;
         struct buffer_head *bh;
-        if (BLOCKS(ntfs_i(inode)->mmu_private) <= file_secno) return 0;
+        if (ntfs_inode->i_fnode_ok)
+                return ntfs_bplus_lookup(inode->i_sb, inode, &ntfs_inode->i_btree.btree, file_secno, NULL);
+        if (!(fnode = ntfs_map_fnode(inode->i_sb, inode->i_ino, &bh))) return -1;
+        ntfs_cache_fnode(inode, fnode);
+        return ntfs_bplus_lookup(inode->i_sb, inode, &fnode->btree, file_secno, bh);
+}
+
+static secno ntfs_bmap(struct inode *inode, unsigned file_secno, unsigned *n_secs)
+{
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
+        unsigned n, disk_secno;
+        if (BLOCKS(ntfs_inode->mmu_private) - ntfs_inode->i_da_secs <= file_secno) return 0;
         n = file_secno - ntfs_inode->i_file_sec;
         if (n < ntfs_inode->i_n_secs) {
                 *n_secs = ntfs_inode->i_n_secs - n;
                 return ntfs_inode->i_disk_sec + n;
         }
-        if (!(fnode = ntfs_map_fnode(inode->i_sb, inode->i_ino, &bh))) return 0;
-        disk_secno = ntfs_bplus_lookup(inode->i_sb, inode, &fnode->btree, file_secno, bh);
+        if (ntfs_find_extent(inode, file_secno)) {
+                n = file_secno - ntfs_inode->i_file_sec;
+                *n_secs = ntfs_inode->i_n_secs - n;
+                return ntfs_inode->i_disk_sec + n;
+        }
+        disk_secno = lookup_sector(inode, file_secno);
         if (disk_secno == -1) return 0;
         if (ntfs_chk_sectors(inode->i_sb, disk_secno, 1, "bmap")) return 0;
         n = file_secno - ntfs_inode->i_file_sec;
@@ -73,17 +93,112 @@ static secno ntfs_bmap(struct inode *inode, unsigned file_secno, unsigned *n_sec
         return disk_secno;
 }
 
+/*
+ * Map a whole run of a file: up to max sectors from file_secno that are
+ * contiguous on disk, across extent boundaries. Returns the first disk
+ * sector and the length in *n_secs, or 0 if file_secno isn't allocated.
+ */
+
+static secno ntfs_map_extent(struct inode *inode, unsigned file_secno, unsigned max, unsigned *n_secs)
+{
+        secno s, next;
+        unsigned n, m;
+        if (!(s = ntfs_bmap(inode, file_secno, &n))) return 0;
+        while (n < max) {
+                next = ntfs_bmap(inode, file_secno + n, &m);
+                if (next != s + n) break;
+                n += m;
+        }
+        *n_secs = min(n, max);
+        return s;
+}
+
+/*
+ * Delayed allocation: buffered writes past the allocated end of the file
+ * only reserve space (i_da_secs sectors after the allocated ones). They
+ * are allocated here, at writeback or when the inode is written, as few
+ * large extents as the free space allows.
+ */
+
+int ntfs_alloc_delayed(struct inode *inode)
+{
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
+        struct super_block *s = inode->i_sb;
+        unsigned fsecno, n;
+        secno sec;
+        int r = 0;
+        ntfs_lock_assert(s);
+        /* The reserved sectors may be used now, see alloc_limit */
+        ntfs_sb(s)->sb_alloc_delayed = 1;
+        while (ntfs_inode->i_da_secs) {
+                fsecno = BLOCKS(ntfs_inode->mmu_private) - ntfs_inode->i_da_secs;
+                n = ntfs_inode->i_da_secs;
+                if ((sec = ntfs_add_sectors_to_btree(s, inode, inode->i_ino, 1, fsecno, &n)) == -1) {
+                        ntfs_truncate_btree(s, inode->i_ino, 1, fsecno);
+                        ntfs_truncate_extents(inode, fsecno);
+                        /* Give up the rest, the file ends where its allocation does */
+                        inode->i_blocks -= ntfs_inode->i_da_secs;
+                        ntfs_unreserve_sectors(inode, ntfs_inode->i_da_secs);
+                        ntfs_inode->mmu_private = (loff_t)fsecno << 9;
+                        if (inode->i_size > ntfs_inode->mmu_private)
+                                i_size_write(inode, ntfs_inode->mmu_private);
+                        r = -ENOSPC;
+                        break;
+                }
+                ntfs_cache_extent(inode, fsecno, sec, n);
+                ntfs_unreserve_sectors(inode, n);
+        }
+        ntfs_sb(s)->sb_alloc_delayed = 0;
+        return r;
+}
+
 void ntfs_truncate(struct inode *i)
 {
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(i);
+        unsigned secs, allocated;
         if (IS_IMMUTABLE(i)) return /*-EPERM*/;
         ntfs_lock_assert(i->i_sb);
 
-        ntfs_i(i)->i_n_secs = 0;
-        i->i_blocks = 1 + ((i->i_size + 511) >> 9);
-        ntfs_i(i)->mmu_private = i->i_size;
-        ntfs_truncate_btree(i->i_sb, i->i_ino, 1, ((i->i_size + 511) >> 9));
+        secs = (i->i_size + 511) >> 9;
+        allocated = BLOCKS(ntfs_inode->mmu_private) - ntfs_inode->i_da_secs;
+        if (ntfs_inode->i_da_secs) {
+                unsigned keep = secs > allocated ? secs - allocated : 0;
+                ntfs_unreserve_sectors(i, ntfs_inode->i_da_secs - keep);
+        }
+        ntfs_release_window(i);
+        ntfs_set_extent(i, 0, 0, 0);
+        ntfs_inode->i_fnode_ok = 0;
+        i->i_blocks = 1 + secs;
+        ntfs_inode->mmu_private = i->i_size;
+        ntfs_truncate_btree(i->i_sb, i->i_ino, 1, min(secs, allocated));
+        ntfs_truncate_extents(i, min(secs, allocated));
         ntfs_write_inode(i);
-        ntfs_i(i)->i_n_secs = 0;
+        ntfs_set_extent(i, 0, 0, 0);
+}
+
+/*
+ * Map a block from the extent cache alone. This takes no lock at all, so
+ * reads of files whose extent is cached don't serialize.
+ */
+
+static int get_block_cached(struct inode *inode, sector_t iblock, struct buffer_head *bh_result)
+{
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
+        unsigned seq, file_sec, disk_sec, n, n_secs;
+        do {
+                seq = read_seqcount_begin(&ntfs_inode->i_extent_seq);
+                file_sec = ntfs_inode->i_file_sec;
+                disk_sec = ntfs_inode->i_disk_sec;
+                n_secs = ntfs_inode->i_n_secs;
+        } while (read_seqcount_retry(&ntfs_inode->i_extent_seq, seq));
+        n = iblock - file_sec;
+        if (iblock < file_sec || n >= n_secs) return 0;
+        n_secs -= n;
+        if (bh_result->b_size >> 9 < n_secs)
+                n_secs = bh_result->b_size >> 9;
+        map_bh(bh_result, inode->i_sb, disk_sec + n);
+        bh_result->b_size = n_secs << 9;
+        return 1;
 }
 
 static int ntfs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
@@ -91,26 +206,34 @@ static int ntfs_get_block(struct inode *inode, sector_t iblock, struct buffer_he
         int r;
         secno s;
         unsigned n_secs;
+        if (get_block_cached(inode, iblock, bh_result)) return 0;
         ntfs_lock(inode->i_sb);
-        s = ntfs_bmap(inode, iblock, &n_secs);
+        retry:
+        s = ntfs_map_extent(inode, iblock, max(bh_result->b_size >> 9, (size_t)1), &n_secs);
         if (s) {
-                if (bh_result->b_size >> 9 < n_secs)
-                        n_secs = bh_result->b_size >> 9;
                 map_bh(bh_result, inode->i_sb, s);
                 bh_result->b_size = n_secs << 9;
                 goto ret_0;
         }
         if (!create) goto ret_0;
+        if (ntfs_i(inode)->i_da_secs) {
+                /* Writeback of a delayed block: allocate the whole range */
+                if ((r = ntfs_alloc_delayed(inode))) goto ret_r;
+                goto retry;
+        }
         if (iblock<<9 != ntfs_i(inode)->mmu_private) {
                 BUG();
                 r = -EIO;
                 goto ret_r;
         }
-        if ((s = ntfs_add_sector_to_btree(inode->i_sb, inode->i_ino, 1, inode->i_blocks - 1)) == -1) {
+        n_secs = 1;
+        if ((s = ntfs_add_sectors_to_btree(inode->i_sb, inode, inode->i_ino, 1, inode->i_blocks - 1, &n_secs)) == -1) {
                 ntfs_truncate_btree(inode->i_sb, inode->i_ino, 1, inode->i_blocks - 1);
+                ntfs_truncate_extents(inode, inode->i_blocks - 1);
                 r = -ENOSPC;
                 goto ret_r;
         }
+        ntfs_cache_extent(inode, inode->i_blocks - 1, s, n_secs);
         inode->i_blocks++;
         ntfs_i(inode)->mmu_private += 512;
         set_buffer_new(bh_result);
@@ -122,6 +245,45 @@ static int ntfs_get_block(struct inode *inode, sector_t iblock, struct buffer_he
         return r;
 }
 
+/*
+ * get_block for write_begin: blocks past the allocated end are only
+ * reserved and left unmapped with BH_Delay set. Writeback calls
+ * ntfs_get_block for them, which allocates them.
+ */
+
+static int ntfs_get_block_delay(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
+{
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
+        int r = 0;
+        secno s;
+        unsigned n_secs;
+        ntfs_lock(inode->i_sb);
+        s = ntfs_map_extent(inode, iblock, max(bh_result->b_size >> 9, (size_t)1), &n_secs);
+        if (s) {
+                map_bh(bh_result, inode->i_sb, s);
+                bh_result->b_size = n_secs << 9;
+                goto ret;
+        }
+        if (iblock >= BLOCKS(ntfs_inode->mmu_private)) {
+                if (!create) goto ret;
+                if (iblock<<9 != ntfs_inode->mmu_private) {
+                        BUG();
+                        r = -EIO;
+                        goto ret;
+                }
+                if ((r = ntfs_reserve_sectors(inode, 1))) goto ret;
+                inode->i_blocks++;
+                ntfs_inode->mmu_private += 512;
+                set_buffer_new(bh_result);
+        }
+        bh_result->b_bdev = inode->i_sb->s_bdev;
+        bh_result->b_blocknr = -1;
+        set_buffer_delay(bh_result);
+        ret:
+        ntfs_unlock(inode->i_sb);
+        return r;
+}
+
 static int ntfs_readpage(struct file *file, struct page *page)
 {
         return mpage_readpage(page, ntfs_get_block);
@@ -166,7 +328,7 @@ static int ntfs_write_begin(struct file *file, struct address_space *mapping,
 
         *pagep = NULL;
         ret = cont_write_begin(file, mapping, pos, len, flags, pagep, fsdata,
-                                ntfs_get_block,
+                                ntfs_get_block_delay,
                                 &ntfs_i(mapping->host)->mmu_private);
         if (unlikely(ret))
                 ntfs_write_failed(mapping, pos + len);
@@ -194,9 +356,379 @@ static int ntfs_write_end(struct file *file, struct address_space *mapping,
 
 static sector_t _ntfs_bmap(struct address_space *mapping, sector_t block)
 {
+        /* Delayed blocks have no disk address until written back */
+        if (ntfs_i(mapping->host)->i_da_secs)
+                filemap_write_and_wait(mapping);
         return generic_block_bmap(mapping,block,ntfs_get_block);
 }
 
+/*
+ * Online defragmentation. The file is laid out again in as few extents as
+ * the free space allows. Data goes through the page cache to the new
+ * sectors, and only then is the fnode switched to the new extents with a
+ * single sector write, so the file is always complete on disk. The new
+ * tree is at most one level deep: up to 8 extents in the fnode, or up to
+ * 12 anodes of 40 extents each. The old sectors are freed last, after the
+ * page cache has forgotten their mapping.
+ */
+
+#define DEFRAG_MAX_EXTENTS      (12 * 40)
+
+static int count_extents(struct inode *inode, unsigned secs)
+{
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
+        unsigned fsecno = 0;
+        int n = 0;
+        while (fsecno < secs) {
+                if (lookup_sector(inode, fsecno) == -1) return -1;
+                fsecno = ntfs_inode->i_file_sec + ntfs_inode->i_n_secs;
+                n++;
+        }
+        return n;
+}
+
+/* Allocate the new layout, giving up when it wouldn't be better */
+
+static int defrag_alloc(struct super_block *s, secno near, unsigned secs,
+                        struct bplus_leaf_node *ext, int max)
+{
+        unsigned fsecno = 0, want, got;
+        secno sec;
+        int n = 0;
+        while (fsecno < secs) {
+                if (n && (got = ntfs_alloc_run_at(s, le32_to_cpu(ext[n - 1].disk_secno) + le32_to_cpu(ext[n - 1].length), secs - fsecno))) {
+                        le32_add_cpu(&ext[n - 1].length, got);
+                        fsecno += got;
+                        continue;
+                }
+                if (n == max) goto fail;
+                want = min(secs - fsecno, 0x4000U);
+                while (!(sec = ntfs_alloc_extent(s, near, want, secs - fsecno, &got))) {
+                        if (want == 1) goto fail;
+                        want /= 2;
+                }
+                ext[n].file_secno = cpu_to_le32(fsecno);
+                ext[n].disk_secno = cpu_to_le32(sec);
+                ext[n].length = cpu_to_le32(got);
+                n++;
+                fsecno += got;
+                near = sec + got;
+        }
+        return n;
+        fail:
+        ntfs_free_extents(s, ext, n);
+        return -1;
+}
+
+static int defrag_copy(struct inode *inode, struct bplus_leaf_node *ext, int n)
+{
+        struct super_block *s = inode->i_sb;
+        struct page *page;
+        struct buffer_head *bh;
+        unsigned fsecno, end;
+        secno sec;
+        void *data;
+        int i;
+        for (i = 0; i < n; i++) {
+                fsecno = le32_to_cpu(ext[i].file_secno);
+                end = fsecno + le32_to_cpu(ext[i].length);
+                sec = le32_to_cpu(ext[i].disk_secno);
+                while (fsecno < end) {
+                        unsigned p = fsecno >> (PAGE_CACHE_SHIFT - 9);
+                        page = read_mapping_page(inode->i_mapping, p, NULL);
+                        if (IS_ERR(page)) return PTR_ERR(page);
+                        ntfs_lock(s);
+                        do {
+                                if (!(data = ntfs_get_sector(s, sec, &bh))) {
+                                        ntfs_unlock(s);
+                                        page_cache_release(page);
+                                        return -EIO;
+                                }
+                                memcpy(data, kmap(page) + ((fsecno << 9) & ~PAGE_CACHE_MASK), 512);
+                                kunmap(page);
+                                mark_buffer_dirty(bh);
+                                brelse(bh);
+                                fsecno++;
+                                sec++;
+                        } while (fsecno < end && fsecno >> (PAGE_CACHE_SHIFT - 9) == p);
+                        ntfs_unlock(s);
+                        page_cache_release(page);
+                }
+        }
+        return sync_blockdev(s->s_bdev);
+}
+
+/*
+ * Put a new tree root into the fnode, saving the old one to *old if asked,
+ * and forget the cached mapping.
+ */
+
+static int defrag_switch(struct inode *inode, struct fnode_btree *new, struct fnode_btree *old)
+{
+        struct fnode *fnode;
+        struct buffer_head *bh;
+        if (!(fnode = ntfs_map_fnode(inode->i_sb, inode->i_ino, &bh))) return -EIO;
+        if (old) memcpy(old, &fnode->btree, sizeof(*old));
+        new->btree.flags = (new->btree.flags & BP_internal) | (fnode->btree.flags & ~BP_internal);
+        memcpy(&fnode->btree, new, sizeof(*new));
+        mark_buffer_dirty(bh);
+        brelse(bh);
+        ntfs_set_extent(inode, 0, 0, 0);
+        ntfs_i(inode)->i_fnode_ok = 0;
+        ntfs_drop_extents(inode);
+        return 0;
+}
+
+/* Build the new tree; anodes are written, the fnode's part goes to *bt */
+
+static int defrag_build(struct inode *inode, struct bplus_leaf_node *ext, int n,
+                        struct fnode_btree *bt)
+{
+        struct super_block *s = inode->i_sb;
+        struct anode *anode;
+        struct buffer_head *bh;
+        anode_secno ano[12];
+        int i, j, k;
+        memset(bt, 0, sizeof(*bt));
+        if (n <= 8) {
+                bt->btree.n_used_nodes = n;
+                bt->btree.n_free_nodes = 8 - n;
+                bt->btree.first_free = cpu_to_le16(8 + 12 * n);
+                memcpy(bt->u.external, ext, n * 12);
+                return 0;
+        }
+        k = (n + 39) / 40;
+        for (i = 0; i < k; i++) {
+                if (!(anode = ntfs_alloc_anode(s, inode->i_ino, &ano[i], &bh))) {
+                        while (i--) ntfs_free_sectors(s, ano[i], 1);
+                        return -ENOSPC;
+                }
+                j = min(n - i * 40, 40);
+                anode->up = cpu_to_le32(inode->i_ino);
+                anode->btree.flags |= BP_fnode_parent;
+                anode->btree.n_used_nodes = j;
+                anode->btree.n_free_nodes = 40 - j;
+                anode->btree.first_free = cpu_to_le16(8 + 12 * j);
+                memcpy(anode->u.external, ext + i * 40, j * 12);
+                mark_buffer_dirty(bh);
+                brelse(bh);
+                bt->u.internal[i].down = cpu_to_le32(ano[i]);
+                bt->u.internal[i].file_secno = i == k - 1 ? cpu_to_le32(-1) : ext[i * 40 + 40].file_secno;
+        }
+        bt->btree.flags = BP_internal;
+        bt->btree.n_used_nodes = k;
+        bt->btree.n_free_nodes = 12 - k;
+        bt->btree.first_free = cpu_to_le16(8 + 8 * k);
+        return 0;
+}
+
+static int ntfs_defrag_file(struct inode *inode)
+{
+        struct super_block *s = inode->i_sb;
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
+        struct bplus_leaf_node *ext;
+        struct fnode_btree *new, *old;
+        unsigned secs;
+        int n, n_old;
+        int r;
+        if (!(ext = kmalloc(DEFRAG_MAX_EXTENTS * sizeof(*ext) + 2 * sizeof(*new), GFP_NOFS)))
+                return -ENOMEM;
+        new = (struct fnode_btree *)(ext + DEFRAG_MAX_EXTENTS);
+        old = new + 1;
+        mutex_lock(&inode->i_mutex);
+        /* Direct I/O in flight maps the old sectors */
+        inode_dio_wait(inode);
+        /*
+         * Writes through mmap wait in ntfs_page_mkwrite until we are done.
+         * Writeback write-protects the pages, so they all fault first.
+         */
+        down_write(&ntfs_inode->i_mmap_sem);
+        if ((r = filemap_write_and_wait(inode->i_mapping))) goto unlock;
+        ntfs_lock(s);
+        if ((r = ntfs_alloc_delayed(inode))) goto unlock_s;
+        ntfs_release_window(inode);
+        secs = BLOCKS(ntfs_inode->mmu_private);
+        if ((n_old = count_extents(inode, secs)) < 0) {
+                r = -EIO;
+                goto unlock_s;
+        }
+        r = 0;
+        if (n_old <= 1) goto unlock_s;
+        r = -ENOSPC;
+        if ((n = defrag_alloc(s, inode->i_ino, secs, ext, min(n_old - 1, DEFRAG_MAX_EXTENTS))) < 0)
+                goto unlock_s;
+        ntfs_unlock(s);
+
+        if ((r = defrag_copy(inode, ext, n))) goto free_new;
+        ntfs_lock(s);
+        if ((r = defrag_build(inode, ext, n, new))) goto free_new_s;
+        if ((r = defrag_switch(inode, new, old))) {
+                ntfs_remove_btree(s, &new->btree);
+                goto unlock_s;
+        }
+        ntfs_unlock(s);
+
+        /*
+         * Buffers in the page cache still point to the old sectors. No page
+         * can be dirty, but if one can't be dropped all the same, go back to
+         * the old tree rather than leave it mapped to sectors we free.
+         */
+        if (invalidate_inode_pages2(inode->i_mapping)) {
+                ntfs_lock(s);
+                if ((r = defrag_switch(inode, old, NULL))) {
+                        printk("NTFS: file %08lx: can't switch back to the old layout, old sectors not freed\n", inode->i_ino);
+                        goto unlock_s;
+                }
+                ntfs_unlock(s);
+                r = -EBUSY;
+                /* Pages read meanwhile point to the new sectors */
+                if (invalidate_inode_pages2(inode->i_mapping)) {
+                        printk("NTFS: file %08lx is busy, sectors of the new layout not freed\n", inode->i_ino);
+                        goto unlock;
+                }
+                ntfs_lock(s);
+                ntfs_remove_btree(s, &new->btree);
+                goto unlock_s;
+        }
+        ntfs_lock(s);
+        ntfs_remove_btree(s, &old->btree);
+        goto unlock_s;
+
+        free_new:
+        ntfs_lock(s);
+        free_new_s:
+        ntfs_free_extents(s, ext, n);
+        unlock_s:
+        ntfs_unlock(s);
+        unlock:
+        up_write(&ntfs_inode->i_mmap_sem);
+        mutex_unlock(&inode->i_mutex);
+        kfree(ext);
+        return r;
+}
+
+long ntfs_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+        struct inode *inode = file_inode(file);
+        int r;
+        switch (cmd) {
+        case NTFS_IOC_DEFRAG:
+                if (!inode_owner_or_capable(inode)) return -EACCES;
+                if ((r = mnt_want_write_file(file))) return r;
+                if (S_ISDIR(inode->i_mode)) r = ntfs_defrag_dtree(inode);
+                else if (S_ISREG(inode->i_mode)) r = ntfs_defrag_file(inode);
+                else r = -EINVAL;
+                mnt_drop_write_file(file);
+                return r;
+        case FITRIM: {
+                struct request_queue *q = bdev_get_queue(inode->i_sb->s_bdev);
+                struct fstrim_range range;
+                unsigned trimmed;
+                u64 end;
+                if (!capable(CAP_SYS_ADMIN)) return -EPERM;
+                if (!blk_queue_discard(q)) return -EOPNOTSUPP;
+                if (copy_from_user(&range, (struct fstrim_range __user *)arg, sizeof(range)))
+                        return -EFAULT;
+                range.minlen = max(range.minlen, (u64)q->limits.discard_granularity);
+                if (range.start >> 9 >= ntfs_sb(inode->i_sb)->sb_fs_size) return -EINVAL;
+                end = range.start + range.len < range.start ? -1ULL : range.start + range.len;
+                end = min(end >> 9, (u64)ntfs_sb(inode->i_sb)->sb_fs_size);
+                r = ntfs_trim_fs(inode->i_sb, range.start >> 9, end,
+                                 min((range.minlen + 511) >> 9, (u64)0x4000), &trimmed);
+                if (r) return r;
+                range.len = (u64)trimmed << 9;
+                if (copy_to_user((struct fstrim_range __user *)arg, &range, sizeof(range)))
+                        return -EFAULT;
+                return 0;
+        }
+        }
+        return -ENOTTY;
+}
+
+#ifdef CONFIG_COMPAT
+long ntfs_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+        return ntfs_ioctl(file, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
+/*
+ * Direct I/O maps through ntfs_get_block, so it gets whole runs and the
+ * lockless extent cache. Writes that would extend the allocated part of
+ * the file and requests not aligned to sectors return 0, and the caller
+ * falls back to buffered I/O for them.
+ */
+
+static ssize_t ntfs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov,
+                              loff_t offset, unsigned long nr_segs)
+{
+        struct inode *inode = iocb->ki_filp->f_mapping->host;
+        size_t count = iov_length(iov, nr_segs);
+        unsigned long seg;
+        ssize_t ret;
+        if ((offset | count) & 511) return 0;
+        for (seg = 0; seg < nr_segs; seg++)
+                if (((unsigned long)iov[seg].iov_base | iov[seg].iov_len) & 511) return 0;
+        if ((rw & WRITE) && ntfs_i(inode)->mmu_private < offset + count) return 0;
+        ret = blockdev_direct_IO(rw, iocb, inode, iov, offset, nr_segs, ntfs_get_block);
+        if (ret < 0 && (rw & WRITE))
+                ntfs_write_failed(iocb->ki_filp->f_mapping, offset + count);
+        return ret;
+}
+
+/*
+ * Report the allocation tree one leaf at a time. The extents are copied
+ * out with ntfs_lock held and given to userspace after it is dropped, as
+ * copying them may fault on a page of this filesystem. Sectors reserved
+ * by delayed allocation are reported as one extent at the end.
+ */
+
+static int ntfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo, u64 start, u64 len)
+{
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(inode);
+        struct super_block *s = inode->i_sb;
+        struct ntfs_extent ext[40];
+        struct fnode *fnode;
+        struct buffer_head *bh;
+        unsigned sec, last, allocated, da;
+        u64 end;
+        int i, n, r;
+        if ((r = fiemap_check_flags(fieinfo, FIEMAP_FLAG_SYNC))) return r;
+        if (!len) return 0;
+        end = start + len < start ? -1ULL : start + len;
+        sec = min(start >> 9, (u64)-1U);
+        last = min((end - 1) >> 9, (u64)-1U);
+        do {
+                ntfs_lock(s);
+                allocated = BLOCKS(ntfs_inode->mmu_private) - ntfs_inode->i_da_secs;
+                da = ntfs_inode->i_da_secs;
+                if (sec >= allocated) n = 0;
+                else if (ntfs_inode->i_fnode_ok)
+                        n = ntfs_bplus_leaf(s, &ntfs_inode->i_btree.btree, sec, NULL, ext);
+                else if (!(fnode = ntfs_map_fnode(s, inode->i_ino, &bh))) n = -1;
+                else {
+                        ntfs_cache_fnode(inode, fnode);
+                        n = ntfs_bplus_leaf(s, &fnode->btree, sec, bh, ext);
+                }
+                ntfs_unlock(s);
+                if (n < 0) return -EIO;
+                for (i = 0; i < n; i++) {
+                        if (ext[i].file_sec > last) return 0;
+                        r = fiemap_fill_next_extent(fieinfo, (u64)ext[i].file_sec << 9,
+                                        (u64)ext[i].disk_sec << 9, (u64)ext[i].len << 9,
+                                        !da && ext[i].file_sec + ext[i].len >= allocated ? FIEMAP_EXTENT_LAST : 0);
+                        if (r) return r < 0 ? r : 0;
+                        sec = ext[i].file_sec + ext[i].len;
+                }
+        } while (n);
+        if (da && sec <= last && sec < allocated + da) {
+                r = fiemap_fill_next_extent(fieinfo, (u64)allocated << 9, 0, (u64)da << 9,
+                                FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_LAST);
+                if (r < 0) return r;
+        }
+        return 0;
+}
+
 const struct address_space_operations ntfs_aops = {
         .readpage = ntfs_readpage,
         .writepage = ntfs_writepage,
@@ -204,9 +736,35 @@ const struct address_space_operations ntfs_aops = {
         .writepages = ntfs_writepages,
         .write_begin = ntfs_write_begin,
         .write_end = ntfs_write_end,
-        .bmap = _ntfs_bmap
+        .bmap = _ntfs_bmap,
+        .direct_IO = ntfs_direct_IO
 };
 
+/* Writes through mmap wait here while the file is being defragmented */
+
+static int ntfs_page_mkwrite(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(file_inode(vma->vm_file));
+        int r;
+        down_read(&ntfs_inode->i_mmap_sem);
+        r = filemap_page_mkwrite(vma, vmf);
+        up_read(&ntfs_inode->i_mmap_sem);
+        return r;
+}
+
+static const struct vm_operations_struct ntfs_file_vm_ops = {
+        .fault          = filemap_fault,
+        .page_mkwrite   = ntfs_page_mkwrite,
+        .remap_pages    = generic_file_remap_pages,
+};
+
+static int ntfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+        file_accessed(file);
+        vma->vm_ops = &ntfs_file_vm_ops;
+        return 0;
+}
+
 const struct file_operations ntfs_file_ops =
 {
         .llseek         = generic_file_llseek,
@@ -214,13 +772,18 @@ const struct file_operations ntfs_file_ops =
         .aio_read       = generic_file_aio_read,
         .write          = do_sync_write,
         .aio_write      = generic_file_aio_write,
-        .mmap           = generic_file_mmap,
+        .mmap           = ntfs_file_mmap,
         .release        = ntfs_file_release,
         .fsync          = ntfs_file_fsync,
         .splice_read    = generic_file_splice_read,
+        .unlocked_ioctl = ntfs_ioctl,
+#ifdef CONFIG_COMPAT
+        .compat_ioctl   = ntfs_compat_ioctl,
+#endif
 };
 
 const struct inode_operations ntfs_file_iops =
 {
         .setattr        = ntfs_setattr,
+        .fiemap         = ntfs_fiemap,
 };
@@ -36,6 +36,9 @@ void ntfs_init_inode(struct inode *i)
 
         ntfs_inode->i_dno = 0;
         ntfs_inode->i_n_secs = 0;
+        ntfs_inode->i_da_secs = 0;
+        ntfs_inode->i_da_meta = 0;
+        ntfs_inode->i_prealloc_len = 0;
         ntfs_inode->i_file_sec = 0;
         ntfs_inode->i_disk_sec = 0;
         ntfs_inode->i_dpos = 0;
@@ -47,12 +50,28 @@ void ntfs_init_inode(struct inode *i)
 
         ntfs_inode->i_rddir_off = NULL;
         ntfs_inode->i_dirty = 0;
+        ntfs_inode->i_fnode_ok = 0;
+        ntfs_inode->i_extents = NULL;
+        ntfs_inode->i_n_extents = 0;
+        ntfs_inode->i_max_extents = 0;
 
         i->i_ctime.tv_sec = i->i_ctime.tv_nsec = 0;
         i->i_mtime.tv_sec = i->i_mtime.tv_nsec = 0;
         i->i_atime.tv_sec = i->i_atime.tv_nsec = 0;
 }
 
+/*
+ * Keep a copy of a file's allocation tree root, so that ntfs_bmap doesn't
+ * have to map the fnode. Whoever changes the root clears i_fnode_ok.
+ */
+
+void ntfs_cache_fnode(struct inode *i, struct fnode *fnode)
+{
+        if (!S_ISREG(i->i_mode)) return;
+        memcpy(&ntfs_i(i)->i_btree, &fnode->btree, sizeof(struct fnode_btree));
+        ntfs_i(i)->i_fnode_ok = 1;
+}
+
 void ntfs_read_inode(struct inode *i)
 {
         struct buffer_head *bh;
@@ -150,6 +169,7 @@ void ntfs_read_inode(struct inode *i)
                 i->i_blocks = ((i->i_size + 511) >> 9) + 1;
                 i->i_data.a_ops = &ntfs_aops;
                 ntfs_i(i)->mmu_private = i->i_size;
+                ntfs_cache_fnode(i, fnode);
         }
         brelse(bh);
 }
@@ -224,6 +244,13 @@ void ntfs_write_inode_nolock(struct inode *i)
         struct quad_buffer_head qbh;
         struct ntfs_dirent *de;
         if (i->i_ino == ntfs_sb(i->i_sb)->sb_root) return;
+        /*
+         * Don't record a size the allocation tree doesn't cover. If the
+         * reserved sectors can't be allocated, ntfs_alloc_delayed cuts
+         * i_size down to the allocated ones.
+         */
+        if (S_ISREG(i->i_mode) && ntfs_inode->i_da_secs)
+                ntfs_alloc_delayed(i);
         if (!(fnode = ntfs_map_fnode(i->i_sb, i->i_ino, &bh))) return;
         if (i->i_ino != ntfs_sb(i->i_sb)->sb_root && i->i_nlink) {
                 if (!(de = map_fnode_dirent(i->i_sb, i->i_ino, fnode, &qbh))) {
@@ -245,7 +272,7 @@ void ntfs_write_inode_nolock(struct inode *i)
                 de->creation_date = cpu_to_le32(gmt_to_local(i->i_sb, i->i_ctime.tv_sec));
                 de->read_only = !(i->i_mode & 0222);
                 de->ea_size = cpu_to_le32(ntfs_inode->i_ea_size);
-                ntfs_mark_4buffers_dirty(&qbh);
+                ntfs_mark_4buffers_range_dirty(&qbh, (char *)de - (char *)qbh.data, le16_to_cpu(de->length));
                 ntfs_brelse4(&qbh);
         }
         if (S_ISDIR(i->i_mode)) {
@@ -256,7 +283,7 @@ void ntfs_write_inode_nolock(struct inode *i)
                         de->read_only = !(i->i_mode & 0222);
                         de->ea_size = cpu_to_le32(/*ntfs_inode->i_ea_size*/0);
                         de->file_size = cpu_to_le32(0);
-                        ntfs_mark_4buffers_dirty(&qbh);
+                        ntfs_mark_4buffers_range_dirty(&qbh, (char *)de - (char *)qbh.data, le16_to_cpu(de->length));
                         ntfs_brelse4(&qbh);
                 } else
                         ntfs_error(i->i_sb,
@@ -272,6 +299,13 @@ int ntfs_setattr(struct dentry *dentry, struct iattr *attr)
         struct inode *inode = dentry->d_inode;
         int error = -EINVAL;
 
+        /*
+         * Direct I/O in flight must not hit sectors that truncate frees.
+         * Waited for without ntfs_lock, as it takes it in ntfs_get_block.
+         */
+        if (attr->ia_valid & ATTR_SIZE)
+                inode_dio_wait(inode);
+
         ntfs_lock(inode->i_sb);
         if (inode->i_ino == ntfs_sb(inode->i_sb)->sb_root)
                 goto out_unlock;
@@ -319,9 +353,13 @@ void ntfs_evict_inode(struct inode *inode)
 {
         truncate_inode_pages(&inode->i_data, 0);
         clear_inode(inode);
-        if (!inode->i_nlink) {
+        ntfs_drop_extents(inode);
+        if (!inode->i_nlink || ntfs_i(inode)->i_da_secs || !list_empty(&ntfs_i(inode)->i_prealloc_list)) {
                 ntfs_lock(inode->i_sb);
-                ntfs_remove_fnode(inode->i_sb, inode->i_ino);
+                ntfs_unreserve_sectors(inode, ntfs_i(inode)->i_da_secs);
+                ntfs_release_window(inode);
+                if (!inode->i_nlink)
+                        ntfs_remove_fnode(inode->i_sb, inode->i_ino);
                 ntfs_unlock(inode->i_sb);
         }
 }
@@ -20,11 +20,65 @@
  * Foundation,Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <linux/vmalloc.h>
 #include "ntfs_fn.h"
 
+/*
+ * With bitmaps=resident all band bitmaps and the dnode bitmap are read into
+ * one array at mount, the dnode bitmap last. Mapping a bitmap then just
+ * points into the array, and marking it dirty copies only the sectors that
+ * changed to their buffers (see ntfs_mark_4buffers_range_dirty).
+ */
+
+static __le32 *map_resident(struct super_block *s, unsigned n, secno sec,
+                            struct quad_buffer_head *qbh)
+{
+        ntfs_lock_assert(s);
+        qbh->bh[0] = NULL;
+        qbh->s = s;
+        qbh->sec = sec;
+        qbh->data = ntfs_sb(s)->sb_res_bmp + n * 512;
+        return qbh->data;
+}
+
+int ntfs_load_resident_bitmaps(struct super_block *s)
+{
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        unsigned n_bands = (sbi->sb_fs_size + 0x3fff) >> 14;
+        struct quad_buffer_head qbh;
+        __le32 *res, *bmp;
+        unsigned n;
+        if (sbi->sb_res_bmp) return 0;
+        if (!(res = vmalloc((n_bands + 1) * 2048))) {
+                printk("NTFS: out of memory for resident bitmaps\n");
+                return -ENOMEM;
+        }
+        for (n = 0; n <= n_bands; n++) {
+                if (n < n_bands) bmp = ntfs_map_bitmap(s, n, &qbh, "res");
+                else bmp = ntfs_map_dnode_bitmap(s, &qbh);
+                if (!bmp) {
+                        vfree(res);
+                        return -EIO;
+                }
+                memcpy(res + n * 512, bmp, 2048);
+                ntfs_brelse4(&qbh);
+        }
+        sbi->sb_res_bmp = res;
+        return 0;
+}
+
+void ntfs_free_resident_bitmaps(struct super_block *s)
+{
+        vfree(ntfs_sb(s)->sb_res_bmp);
+        ntfs_sb(s)->sb_res_bmp = NULL;
+}
+
 __le32 *ntfs_map_dnode_bitmap(struct super_block *s, struct quad_buffer_head *qbh)
 {
-        return ntfs_map_4sectors(s, ntfs_sb(s)->sb_dmap, qbh, 0);
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        if (sbi->sb_res_bmp)
+                return map_resident(s, (sbi->sb_fs_size + 0x3fff) >> 14, sbi->sb_dmap, qbh);
+        return ntfs_map_4sectors(s, sbi->sb_dmap, qbh, NULL);
 }
 
 __le32 *ntfs_map_bitmap(struct super_block *s, unsigned bmp_block,
@@ -42,23 +96,32 @@ __le32 *ntfs_map_bitmap(struct super_block *s, unsigned bmp_block,
                 ntfs_error(s, "invalid bitmap block pointer %08x -> %08x at %s", bmp_block, sec, id);
                 return NULL;
         }
-        ret = ntfs_map_4sectors(s, sec, qbh, 4);
-        if (ret) ntfs_prefetch_bitmap(s, bmp_block + 1);
+        if (ntfs_sb(s)->sb_res_bmp) return map_resident(s, bmp_block, sec, qbh);
+        ret = ntfs_map_4sectors(s, sec, qbh, NULL);
+        if (ret) {
+                unsigned len;
+                unsigned b = ntfs_ra_window(s, NTFS_RA_BITMAP, bmp_block, 1, &len);
+                for (; len; len--, b++)
+                        if (ntfs_prefetch_bitmap(s, b))
+                                ntfs_ra_issued(s, NTFS_RA_BITMAP, 1);
+        }
         return ret;
 }
 
-void ntfs_prefetch_bitmap(struct super_block *s, unsigned bmp_block)
+/* Returns the number of sectors read */
+
+int ntfs_prefetch_bitmap(struct super_block *s, unsigned bmp_block)
 {
         unsigned to_prefetch, next_prefetch;
         unsigned n_bands = (ntfs_sb(s)->sb_fs_size + 0x3fff) >> 14;
         if (unlikely(bmp_block >= n_bands))
-                return;
+                return 0;
         to_prefetch = le32_to_cpu(ntfs_sb(s)->sb_bmp_dir[bmp_block]);
         if (unlikely(bmp_block + 1 >= n_bands))
                 next_prefetch = 0;
         else
                 next_prefetch = le32_to_cpu(ntfs_sb(s)->sb_bmp_dir[bmp_block + 1]);
-        ntfs_prefetch_sectors(s, to_prefetch, 4 + 4 * (to_prefetch + 4 == next_prefetch));
+        return ntfs_prefetch_sectors(s, to_prefetch, 4 + 4 * (to_prefetch + 4 == next_prefetch));
 }
 
 /*
@@ -144,7 +207,8 @@ __le32 *ntfs_load_bitmap_directory(struct super_block *s, secno bmp)
 }
 
 /*
- * Load fnode to memory
+ * Load fnode to memory. The checks are done once per buffer, the driver
+ * keeps an fnode consistent while it's in memory.
  */
 
 struct fnode *ntfs_map_fnode(struct super_block *s, ino_t ino, struct buffer_head **bhp)
@@ -153,8 +217,9 @@ struct fnode *ntfs_map_fnode(struct super_block *s, ino_t ino, struct buffer_hea
         if (ntfs_sb(s)->sb_chk) if (ntfs_chk_sectors(s, ino, 1, "fnode")) {
                 return NULL;
         }
-        if ((fnode = ntfs_map_sector(s, ino, bhp, FNODE_RD_AHEAD))) {
-                if (ntfs_sb(s)->sb_chk) {
+        ntfs_readahead(s, NTFS_RA_FNODE, ino, 1);
+        if ((fnode = ntfs_map_sector(s, ino, bhp, 0))) {
+                if (ntfs_sb(s)->sb_chk && !buffer_fnode_checked(*bhp)) {
                         struct extended_attribute *ea;
                         struct extended_attribute *ea_end;
                         if (le32_to_cpu(fnode->magic) != FNODE_MAGIC) {
@@ -196,6 +261,7 @@ struct fnode *ntfs_map_fnode(struct super_block *s, ino_t ino, struct buffer_hea
                                 }
                                 ea = next_ea(ea);
                         }
+                        set_buffer_fnode_checked(*bhp);
                 }
         }
         return fnode;
@@ -208,7 +274,8 @@ struct anode *ntfs_map_anode(struct super_block *s, anode_secno ano, struct buff
 {
         struct anode *anode;
         if (ntfs_sb(s)->sb_chk) if (ntfs_chk_sectors(s, ano, 1, "anode")) return NULL;
-        if ((anode = ntfs_map_sector(s, ano, bhp, ANODE_RD_AHEAD)))
+        ntfs_readahead(s, NTFS_RA_ANODE, ano, 1);
+        if ((anode = ntfs_map_sector(s, ano, bhp, 0)))
                 if (ntfs_sb(s)->sb_chk) {
                         if (le32_to_cpu(anode->magic) != ANODE_MAGIC) {
                                 ntfs_error(s, "bad magic on anode %08x", ano);
@@ -243,6 +310,7 @@ struct dnode *ntfs_map_dnode(struct super_block *s, unsigned secno,
                              struct quad_buffer_head *qbh)
 {
         struct dnode *dnode;
+        unsigned from, len;
         if (ntfs_sb(s)->sb_chk) {
                 if (ntfs_chk_sectors(s, secno, 4, "dnode")) return NULL;
                 if (secno & 3) {
@@ -250,7 +318,15 @@ struct dnode *ntfs_map_dnode(struct super_block *s, unsigned secno,
                         return NULL;
                 }
         }
-        if ((dnode = ntfs_map_4sectors(s, secno, qbh, DNODE_RD_AHEAD)))
+        /* A window starting right behind the dnode is read with it */
+        from = ntfs_ra_window(s, NTFS_RA_DNODE, secno, 4, &len);
+        if (from != secno + 4) {
+                ntfs_ra_issued(s, NTFS_RA_DNODE, ntfs_prefetch_sectors(s, from, len));
+                len = 0;
+        }
+        dnode = ntfs_map_4sectors(s, secno, qbh, &len);
+        ntfs_ra_issued(s, NTFS_RA_DNODE, len);
+        if (dnode)
                 if (ntfs_sb(s)->sb_chk) {
                         unsigned p, pp = 0;
                         unsigned char *d = (unsigned char *)dnode;
@@ -75,7 +75,7 @@ unsigned char *ntfs_translate_name(struct super_block *s, unsigned char *from,
                 printk("NTFS: It's nothing serious. It could happen because of bug in OS/2.\nNTFS: Set checks=normal to disable this message.\n");
         }
         if (!lc) return from;
-        if (!(to = kmalloc(len, GFP_KERNEL))) {
+        if (!(to = ntfs_alloc_name(GFP_NOFS))) {
                 printk("NTFS: can't allocate memory for name conversion buffer\n");
                 return from;
         }
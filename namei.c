@@ -40,7 +40,7 @@ static int ntfs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
         if ((err = ntfs_chk_name(name, &len))) return err==-ENOENT ? -EINVAL : err;
         ntfs_lock(dir->i_sb);
         err = -ENOSPC;
-        fnode = ntfs_alloc_fnode(dir->i_sb, ntfs_i(dir)->i_dno, &fno, &bh);
+        fnode = ntfs_alloc_fnode(dir->i_sb, ntfs_dir_home(dir->i_sb), &fno, &bh);
         if (!fnode)
                 goto bail;
         dnode = ntfs_alloc_dnode(dir->i_sb, fno, &dno, &qbh0);
@@ -144,7 +144,7 @@ static int ntfs_create(struct inode *dir, struct dentry *dentry, umode_t mode, b
                 return err==-ENOENT ? -EINVAL : err;
         ntfs_lock(dir->i_sb);
         err = -ENOSPC;
-        fnode = ntfs_alloc_fnode(dir->i_sb, ntfs_i(dir)->i_dno, &fno, &bh);
+        fnode = ntfs_alloc_fnode(dir->i_sb, dir->i_ino, &fno, &bh);
         if (!fnode)
                 goto bail;
         memset(&dee, 0, sizeof dee);
@@ -232,7 +232,7 @@ static int ntfs_mknod(struct inode *dir, struct dentry *dentry, umode_t mode, de
                 return -EINVAL;
         ntfs_lock(dir->i_sb);
         err = -ENOSPC;
-        fnode = ntfs_alloc_fnode(dir->i_sb, ntfs_i(dir)->i_dno, &fno, &bh);
+        fnode = ntfs_alloc_fnode(dir->i_sb, dir->i_ino, &fno, &bh);
         if (!fnode)
                 goto bail;
         memset(&dee, 0, sizeof dee);
@@ -308,7 +308,7 @@ static int ntfs_symlink(struct inode *dir, struct dentry *dentry, const char *sy
                 return -EPERM;
         }
         err = -ENOSPC;
-        fnode = ntfs_alloc_fnode(dir->i_sb, ntfs_i(dir)->i_dno, &fno, &bh);
+        fnode = ntfs_alloc_fnode(dir->i_sb, dir->i_ino, &fno, &bh);
         if (!fnode)
                 goto bail;
         memset(&dee, 0, sizeof dee);
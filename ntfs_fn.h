@@ -26,6 +26,8 @@
 #include <linux/pagemap.h>
 #include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/rbtree.h>
+#include <linux/workqueue.h>
 #include <asm/unaligned.h>
 
 #include "ntfs.h"
@@ -39,16 +41,42 @@
 #define ALLOC_FWD_MIN   16
 #define ALLOC_FWD_MAX   128
 #define ALLOC_M         1
-#define FNODE_RD_AHEAD  16
-#define ANODE_RD_AHEAD  0
-#define DNODE_RD_AHEAD  72
-#define COUNT_RD_AHEAD  62
+#define COUNT_RD_AHEAD  62      /* bitmaps read ahead when scanning all of them */
 
 #define FREE_DNODES_ADD 58
 #define FREE_DNODES_DEL 29
 
+#define FREE_TREE_MAX   65536   /* most extents in the free space index */
+#define DIR_HOME_SCAN   16      /* bands considered for a new directory */
+#define DISCARD_DELAY   HZ      /* freed sectors are discarded in batches this often */
+
+/* Defragment a file, or move a directory's dnodes into the directory band */
+#define NTFS_IOC_DEFRAG _IO('N', 0x40)
+
 #define CHKCOND(x,y) if (!(x)) printk y
 
+/* Buffer state: the fnode in the buffer passed the checks of ntfs_map_fnode */
+enum { BH_Fnode_checked = BH_PrivateStart };
+BUFFER_FNS(Fnode_checked, fnode_checked)
+
+/* The root of an fnode's allocation tree, with room for its nodes */
+
+struct fnode_btree {
+        struct bplus_header btree;
+        union {
+                struct bplus_leaf_node external[8];
+                struct bplus_internal_node internal[12];
+        } u;
+};
+
+/* A run of sectors of a file, in the extent cache of anode.c */
+
+struct ntfs_extent {
+        unsigned file_sec;
+        unsigned disk_sec;
+        unsigned len;
+};
+
 struct ntfs_inode_info {
         loff_t mmu_private;
         ino_t i_parent_dir;     /* (directories) gives fnode of parent dir */
@@ -58,15 +86,46 @@ struct ntfs_inode_info {
         unsigned i_file_sec;    /* (files) minimalist cache of alloc info */
         unsigned i_disk_sec;    /* (files) minimalist cache of alloc info */
         unsigned i_n_secs;      /* (files) minimalist cache of alloc info */
+        seqcount_t i_extent_seq; /* (files) for the three above, see ntfs_lock */
+        unsigned i_da_secs;     /* (files) sectors reserved, not yet allocated */
+        unsigned i_da_meta;     /* (files) anode sectors reserved for them */
+        unsigned i_prealloc_start; /* (files) preallocation window */
+        unsigned i_prealloc_len;
+        unsigned i_prealloc_gen; /* (files) sb_free_tree_gen of the window */
+        struct list_head i_prealloc_list; /* (files) in sb_windows */
+        struct rw_semaphore i_mmap_sem; /* (files) page_mkwrite against defrag */
         unsigned i_ea_size;     /* size of extended attributes */
         unsigned i_ea_mode : 1; /* file's permission is stored in ea */
         unsigned i_ea_uid : 1;  /* file's uid is stored in ea */
         unsigned i_ea_gid : 1;  /* file's gid is stored in ea */
         unsigned i_dirty : 1;
+        unsigned i_fnode_ok : 1; /* (files) i_btree mirrors the fnode */
+        struct fnode_btree i_btree; /* (files) root of the allocation tree */
+        struct ntfs_extent *i_extents; /* (files) extent cache, sorted */
+        unsigned i_n_extents;
+        unsigned i_max_extents;
+        struct list_head i_extent_lru; /* (files) for the extent shrinker */
         loff_t **i_rddir_off;
         struct inode vfs_inode;
 };
 
+/*
+ * Metadata readahead, see buffer.c. Each class has a window that grows
+ * while the sectors read ahead get used and shrinks when they don't.
+ * Bitmaps are counted in bands, the rest in sectors.
+ */
+
+enum { NTFS_RA_FNODE, NTFS_RA_ANODE, NTFS_RA_DNODE, NTFS_RA_BITMAP, NTFS_RA_CLASSES };
+
+struct ntfs_ra {
+        unsigned start, next, end;      /* last window, used up to next */
+        unsigned size;                  /* current window size */
+        unsigned min, max;
+        unsigned long issued;           /* actually read ahead so far */
+        unsigned long hits;             /* of those, used */
+        unsigned unused;                /* issued in the window, not used yet */
+};
+
 struct ntfs_sb_info {
         struct mutex ntfs_mutex;        /* global ntfs lock */
         ino_t sb_root;                  /* inode number of root dir */
@@ -77,6 +136,8 @@ struct ntfs_sb_info {
         unsigned sb_dmap;               /* sector number of dnode bit map */
         unsigned sb_n_free;             /* free blocks for statfs, or -1 */
         unsigned sb_n_free_dnodes;      /* free dnodes for statfs, or -1 */
+        unsigned sb_n_free_quads;       /* free aligned 4-sector runs in bitmaps */
+        unsigned sb_n_reserved;         /* sectors reserved for delayed alloc, with anodes */
         kuid_t sb_uid;                  /* uid from mount options */
         kgid_t sb_gid;                  /* gid from mount options */
         umode_t sb_mode;                /* mode from mount options */
@@ -86,13 +147,29 @@ struct ntfs_sb_info {
         unsigned sb_lowercase : 1;      /* downcase filenames hackery */
         unsigned sb_was_error : 1;      /* there was an error, set dirty flag */
         unsigned sb_chkdsk : 2;         /* chkdsk: 0-no, 1-on errs, 2-allways */
+        unsigned sb_free_tree_ok : 1;   /* sb_free_tree is valid */
+        unsigned sb_alloc_delayed : 1;  /* allocating reserved sectors */
+        unsigned sb_discard : 1;        /* discard freed sectors */
+        unsigned sb_resident : 1;       /* keep bitmaps in memory */
         unsigned char *sb_cp_table;     /* code page tables: */
                                         /*      128 bytes uppercasing table & */
                                         /*      128 bytes lowercasing table */
         __le32 *sb_bmp_dir;             /* main bitmap directory */
         unsigned sb_c_bitmap;           /* current bitmap */
         unsigned sb_max_fwd_alloc;      /* max forwad allocation */
+        unsigned sb_dir_rotor;          /* where to look for the next directory home */
         int sb_timeshift;
+        struct rb_root sb_free_tree;    /* index of free extents, see alloc.c */
+        unsigned sb_free_tree_count;    /* extents in the index */
+        unsigned *sb_band_free;         /* free sectors in each band */
+        unsigned sb_free_tree_gen;      /* bumped whenever the index is dropped */
+        struct list_head sb_windows;    /* inodes with a preallocation window */
+        struct list_head sb_discard_list; /* freed extents waiting for discard */
+        struct delayed_work sb_discard_work;
+        struct super_block *sb_s;       /* for the discard worker */
+        __le32 *sb_res_bmp;             /* resident bitmaps, see map.c */
+        struct ntfs_ra sb_ra[NTFS_RA_CLASSES]; /* metadata readahead */
+        struct proc_dir_entry *sb_proc; /* /proc/fs/ntfs/<dev> */
 };
 
 /* Four 512-byte buffers and the 2k block obtained by concatenating them */
@@ -100,6 +177,8 @@ struct ntfs_sb_info {
 struct quad_buffer_head {
         struct buffer_head *bh[4];
         void *data;
+        struct super_block *s;          /* resident bitmaps only, */
+        unsigned sec;                   /* bh[0] is NULL for them */
 };
 
 /* The b-tree down pointer from a dir entry */
@@ -185,32 +264,45 @@ static inline void copy_de(struct ntfs_dirent *dst, struct ntfs_dirent *src)
         dst->not_8x3 = n;
 }
 
-static inline unsigned tstbits(__le32 *bmp, unsigned b, unsigned n)
-{
-        int i;
-        if ((b >= 0x4000) || (b + n - 1 >= 0x4000)) return n;
-        if (!((le32_to_cpu(bmp[(b & 0x3fff) >> 5]) >> (b & 0x1f)) & 1)) return 1;
-        for (i = 1; i < n; i++)
-                if (!((le32_to_cpu(bmp[((b+i) & 0x3fff) >> 5]) >> ((b+i) & 0x1f)) & 1))
-                        return i + 1;
-        return 0;
-}
-
 /* alloc.c */
 
 int ntfs_chk_sectors(struct super_block *, secno, int, char *);
+unsigned ntfs_count_free_quads(__le32 *, unsigned, unsigned);
+void ntfs_drop_free_tree(struct super_block *);
+int ntfs_build_free_tree(struct super_block *);
 secno ntfs_alloc_sector(struct super_block *, secno, unsigned, int);
+secno ntfs_dir_home(struct super_block *);
+secno ntfs_alloc_extent(struct super_block *, secno, unsigned, unsigned, unsigned *);
+unsigned ntfs_alloc_run_at(struct super_block *, secno, unsigned);
+secno ntfs_alloc_in_dirband(struct super_block *, secno);
+void ntfs_release_window(struct inode *);
+void ntfs_prealloc_window(struct inode *, secno, unsigned);
+unsigned ntfs_alloc_from_window(struct inode *, secno, unsigned);
+int ntfs_reserve_sectors(struct inode *, unsigned);
+void ntfs_unreserve_sectors(struct inode *, unsigned);
 int ntfs_alloc_if_possible(struct super_block *, secno);
+void ntfs_flush_discards(struct super_block *);
+void ntfs_discard_work(struct work_struct *);
 void ntfs_free_sectors(struct super_block *, secno, unsigned);
+void ntfs_free_extents(struct super_block *, struct bplus_leaf_node *, int);
 int ntfs_check_free_dnodes(struct super_block *, int);
 void ntfs_free_dnode(struct super_block *, secno);
 struct dnode *ntfs_alloc_dnode(struct super_block *, secno, dnode_secno *, struct quad_buffer_head *);
 struct fnode *ntfs_alloc_fnode(struct super_block *, secno, fnode_secno *, struct buffer_head **);
 struct anode *ntfs_alloc_anode(struct super_block *, secno, anode_secno *, struct buffer_head **);
+int ntfs_trim_fs(struct super_block *, secno, secno, unsigned, unsigned *);
 
 /* anode.c */
 
+int ntfs_find_extent(struct inode *, unsigned);
+void ntfs_cache_extent(struct inode *, unsigned, unsigned, unsigned);
+void ntfs_truncate_extents(struct inode *, unsigned);
+void ntfs_drop_extents(struct inode *);
+int ntfs_init_extent_cache(void);
+void ntfs_destroy_extent_cache(void);
 secno ntfs_bplus_lookup(struct super_block *, struct inode *, struct bplus_header *, unsigned, struct buffer_head *);
+int ntfs_bplus_leaf(struct super_block *, struct bplus_header *, unsigned, struct buffer_head *, struct ntfs_extent *);
+secno ntfs_add_sectors_to_btree(struct super_block *, struct inode *, secno, int, unsigned, unsigned *);
 secno ntfs_add_sector_to_btree(struct super_block *, secno, int, unsigned);
 void ntfs_remove_btree(struct super_block *, struct bplus_header *);
 int ntfs_ea_read(struct super_block *, secno, int, unsigned, unsigned, char *);
@@ -221,12 +313,24 @@ void ntfs_remove_fnode(struct super_block *, fnode_secno fno);
 
 /* buffer.c */
 
-void ntfs_prefetch_sectors(struct super_block *, unsigned, int);
+int ntfs_init_buffer_caches(void);
+void ntfs_destroy_buffer_caches(void);
+unsigned char *ntfs_alloc_name(gfp_t);
+void ntfs_free_name(unsigned char *);
+struct dnode *ntfs_alloc_split_dnode(void);
+void ntfs_free_split_dnode(struct dnode *);
+int ntfs_prefetch_sectors(struct super_block *, unsigned, int);
+void ntfs_init_readahead(struct super_block *);
+unsigned ntfs_ra_window(struct super_block *, int, unsigned, unsigned, unsigned *);
+void ntfs_ra_issued(struct super_block *, int, unsigned);
+void ntfs_readahead(struct super_block *, int, unsigned, unsigned);
+extern const struct file_operations ntfs_ra_proc_fops;
 void *ntfs_map_sector(struct super_block *, unsigned, struct buffer_head **, int);
 void *ntfs_get_sector(struct super_block *, unsigned, struct buffer_head **);
-void *ntfs_map_4sectors(struct super_block *, unsigned, struct quad_buffer_head *, int);
+void *ntfs_map_4sectors(struct super_block *, unsigned, struct quad_buffer_head *, unsigned *);
 void *ntfs_get_4sectors(struct super_block *, unsigned, struct quad_buffer_head *);
 void ntfs_brelse4(struct quad_buffer_head *);
+void ntfs_mark_4buffers_range_dirty(struct quad_buffer_head *, unsigned, unsigned);
 void ntfs_mark_4buffers_dirty(struct quad_buffer_head *);
 
 /* dentry.c */
@@ -254,6 +358,7 @@ struct ntfs_dirent *map_dirent(struct inode *, dnode_secno,
                                const unsigned char *, unsigned, dnode_secno *,
                                struct quad_buffer_head *);
 void ntfs_remove_dtree(struct super_block *, dnode_secno);
+int ntfs_defrag_dtree(struct inode *);
 struct ntfs_dirent *map_fnode_dirent(struct super_block *, fnode_secno, struct fnode *, struct quad_buffer_head *);
 
 /* ea.c */
@@ -267,13 +372,17 @@ void ntfs_set_ea(struct inode *, struct fnode *, const char *,
 /* file.c */
 
 int ntfs_file_fsync(struct file *, loff_t, loff_t, int);
+int ntfs_alloc_delayed(struct inode *);
 void ntfs_truncate(struct inode *);
+long ntfs_ioctl(struct file *, unsigned int, unsigned long);
+long ntfs_compat_ioctl(struct file *, unsigned int, unsigned long);
 extern const struct file_operations ntfs_file_ops;
 extern const struct inode_operations ntfs_file_iops;
 extern const struct address_space_operations ntfs_aops;
 
 /* inode.c */
 
+void ntfs_cache_fnode(struct inode *, struct fnode *);
 void ntfs_init_inode(struct inode *);
 void ntfs_read_inode(struct inode *);
 void ntfs_write_inode(struct inode *);
@@ -284,9 +393,11 @@ void ntfs_evict_inode(struct inode *);
 
 /* map.c */
 
+int ntfs_load_resident_bitmaps(struct super_block *);
+void ntfs_free_resident_bitmaps(struct super_block *);
 __le32 *ntfs_map_dnode_bitmap(struct super_block *, struct quad_buffer_head *);
 __le32 *ntfs_map_bitmap(struct super_block *, unsigned, struct quad_buffer_head *, char *);
-void ntfs_prefetch_bitmap(struct super_block *, unsigned);
+int ntfs_prefetch_bitmap(struct super_block *, unsigned);
 unsigned char *ntfs_load_code_page(struct super_block *, secno);
 __le32 *ntfs_load_bitmap_directory(struct super_block *, secno bmp);
 struct fnode *ntfs_map_fnode(struct super_block *s, ino_t, struct buffer_head **);
@@ -324,7 +435,7 @@ static inline struct ntfs_sb_info *ntfs_sb(struct super_block *sb)
 __printf(2, 3)
 void ntfs_error(struct super_block *, const char *, ...);
 int ntfs_stop_cycles(struct super_block *, int, int *, int *, char *);
-unsigned ntfs_count_one_bitmap(struct super_block *, secno);
+unsigned ntfs_count_one_bitmap(struct super_block *, secno, unsigned *);
 
 /*
  * local time (NTFS) to GMT (Unix)
@@ -346,10 +457,20 @@ static inline time32_t gmt_to_local(struct super_block *s, time_t t)
  * Locking:
  *
  * ntfs_lock() locks the whole filesystem. It must be taken
- * on any method called by the VFS.
+ * on any method called by the VFS that touches disk structures.
  *
  * We don't do any per-file locking anymore, it is hard to
- * review and NTFS is not performance-sensitive anyway.
+ * review. Two per-inode locks are exceptions, the order is
+ *
+ *      i_mutex -> i_mmap_sem -> ntfs_mutex -> i_extent_seq
+ *
+ * i_mmap_sem is taken for reading by page_mkwrite and for writing by
+ * defragmentation, so that pages can't be dirtied through mmap while
+ * the file is being moved.
+ *
+ * i_extent_seq is a seqcount for the extent cache. It is only written
+ * with ntfs_lock held; ntfs_get_block reads the cache without taking
+ * any lock and retries if it changed meanwhile.
  */
 static inline void ntfs_lock(struct super_block *s)
 {
@@ -368,3 +489,18 @@ static inline void ntfs_lock_assert(struct super_block *s)
         struct ntfs_sb_info *sbi = ntfs_sb(s);
         WARN_ON(!mutex_is_locked(&sbi->ntfs_mutex));
 }
+
+/* Set the extent cache of a file, n == 0 empties it */
+
+static inline void ntfs_set_extent(struct inode *i, unsigned file_sec, unsigned disk_sec, unsigned n)
+{
+        struct ntfs_inode_info *ntfs_inode = ntfs_i(i);
+        lockdep_assert_held(&ntfs_sb(i->i_sb)->ntfs_mutex);
+        preempt_disable();
+        write_seqcount_begin(&ntfs_inode->i_extent_seq);
+        ntfs_inode->i_file_sec = file_sec;
+        ntfs_inode->i_disk_sec = disk_sec;
+        ntfs_inode->i_n_secs = n;
+        write_seqcount_end(&ntfs_inode->i_extent_seq);
+        preempt_enable();
+}
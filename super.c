@@ -29,6 +29,8 @@
 #include <linux/sched.h>
 #include <linux/bitmap.h>
 #include <linux/slab.h>
+#include <linux/blkdev.h>
+#include <linux/proc_fs.h>
 
 /* Mark the filesystem dirty, so that chkdsk checks it when os/2 booted */
 
@@ -115,47 +117,73 @@ int ntfs_stop_cycles(struct super_block *s, int key, int *c1, int *c2,
         return 0;
 }
 
+static struct proc_dir_entry *ntfs_proc_root;
+
 static void ntfs_put_super(struct super_block *s)
 {
         struct ntfs_sb_info *sbi = ntfs_sb(s);
 
+        if (sbi->sb_proc) {
+                remove_proc_entry("readahead", sbi->sb_proc);
+                remove_proc_entry(s->s_id, ntfs_proc_root);
+        }
+
+        cancel_delayed_work_sync(&sbi->sb_discard_work);
+        ntfs_flush_discards(s);
+
         ntfs_lock(s);
         unmark_dirty(s);
+        ntfs_drop_free_tree(s);
+        ntfs_free_resident_bitmaps(s);
         ntfs_unlock(s);
 
         kfree(sbi->sb_cp_table);
         kfree(sbi->sb_bmp_dir);
+        kfree(sbi->sb_band_free);
         s->s_fs_info = NULL;
         kfree(sbi);
 }
 
-unsigned ntfs_count_one_bitmap(struct super_block *s, secno secno)
+unsigned ntfs_count_one_bitmap(struct super_block *s, secno secno, unsigned *quads)
 {
         struct quad_buffer_head qbh;
         unsigned long *bits;
         unsigned count;
 
-        bits = ntfs_map_4sectors(s, secno, &qbh, 0);
+        bits = ntfs_map_4sectors(s, secno, &qbh, NULL);
         if (!bits)
                 return 0;
         count = bitmap_weight(bits, 2048 * BITS_PER_BYTE);
+        if (quads) *quads += ntfs_count_free_quads((__le32 *)bits, 0, 0x4000);
         ntfs_brelse4(&qbh);
         return count;
 }
 
-static unsigned count_bitmaps(struct super_block *s)
+/*
+ * Count free sectors, dnodes and aligned quads for dnodes outside the
+ * directory band. The per-band counts, if we have the array, are filled
+ * in too. Allocation and freeing keep the counts up to date afterwards,
+ * so this is done at mount time only.
+ */
+
+static void count_bitmaps(struct super_block *s)
 {
-        unsigned n, count, n_bands;
-        n_bands = (ntfs_sb(s)->sb_fs_size + 0x3fff) >> 14;
+        struct ntfs_sb_info *sbi = ntfs_sb(s);
+        unsigned n, count, c, n_bands;
+        n_bands = (sbi->sb_fs_size + 0x3fff) >> 14;
         count = 0;
+        sbi->sb_n_free_quads = 0;
         for (n = 0; n < COUNT_RD_AHEAD; n++) {
                 ntfs_prefetch_bitmap(s, n);
         }
         for (n = 0; n < n_bands; n++) {
                 ntfs_prefetch_bitmap(s, n + COUNT_RD_AHEAD);
-                count += ntfs_count_one_bitmap(s, le32_to_cpu(ntfs_sb(s)->sb_bmp_dir[n]));
+                c = ntfs_count_one_bitmap(s, le32_to_cpu(sbi->sb_bmp_dir[n]), &sbi->sb_n_free_quads);
+                if (sbi->sb_band_free) sbi->sb_band_free[n] = c;
+                count += c;
         }
-        return count;
+        sbi->sb_n_free = count;
+        sbi->sb_n_free_dnodes = ntfs_count_one_bitmap(s, sbi->sb_dmap, NULL);
 }
 
 static int ntfs_statfs(struct dentry *dentry, struct kstatfs *buf)
@@ -165,15 +193,13 @@ static int ntfs_statfs(struct dentry *dentry, struct kstatfs *buf)
         u64 id = huge_encode_dev(s->s_bdev->bd_dev);
         ntfs_lock(s);
 
-        /*if (sbi->sb_n_free == -1) {*/
-                sbi->sb_n_free = count_bitmaps(s);
-                sbi->sb_n_free_dnodes = ntfs_count_one_bitmap(s, sbi->sb_dmap);
-        /*}*/
+        if (sbi->sb_n_free == -1 || sbi->sb_n_free_dnodes == -1)
+                count_bitmaps(s);
         buf->f_type = s->s_magic;
         buf->f_bsize = 512;
         buf->f_blocks = sbi->sb_fs_size;
-        buf->f_bfree = sbi->sb_n_free;
-        buf->f_bavail = sbi->sb_n_free;
+        buf->f_bfree = sbi->sb_n_free > sbi->sb_n_reserved ? sbi->sb_n_free - sbi->sb_n_reserved : 0;
+        buf->f_bavail = buf->f_bfree;
         buf->f_files = sbi->sb_dirband_size / 4;
         buf->f_ffree = sbi->sb_n_free_dnodes;
         buf->f_fsid.val[0] = (u32)id;
@@ -213,6 +239,10 @@ static void init_once(void *foo)
         struct ntfs_inode_info *ei = (struct ntfs_inode_info *) foo;
 
         inode_init_once(&ei->vfs_inode);
+        seqcount_init(&ei->i_extent_seq);
+        INIT_LIST_HEAD(&ei->i_extent_lru);
+        INIT_LIST_HEAD(&ei->i_prealloc_list);
+        init_rwsem(&ei->i_mmap_sem);
 }
 
 static int init_inodecache(void)
@@ -249,7 +279,8 @@ enum {
         Opt_err_cont, Opt_err_ro, Opt_err_panic,
         Opt_eas_no, Opt_eas_ro, Opt_eas_rw,
         Opt_chkdsk_no, Opt_chkdsk_errors, Opt_chkdsk_always,
-        Opt_timeshift, Opt_err,
+        Opt_timeshift, Opt_discard, Opt_nodiscard,
+        Opt_bitmaps_cached, Opt_bitmaps_resident, Opt_err,
 };
 
 static const match_table_t tokens = {
@@ -272,12 +303,17 @@ static const match_table_t tokens = {
         {Opt_chkdsk_errors, "chkdsk=errors"},
         {Opt_chkdsk_always, "chkdsk=always"},
         {Opt_timeshift, "timeshift=%d"},
+        {Opt_discard, "discard"},
+        {Opt_nodiscard, "nodiscard"},
+        {Opt_bitmaps_cached, "bitmaps=cached"},
+        {Opt_bitmaps_resident, "bitmaps=resident"},
         {Opt_err, NULL},
 };
 
 static int parse_opts(char *opts, kuid_t *uid, kgid_t *gid, umode_t *umask,
                       int *lowercase, int *eas, int *chk, int *errs,
-                      int *chkdsk, int *timeshift)
+                      int *chkdsk, int *timeshift, int *discard,
+                      int *resident)
 {
         char *p;
         int option;
@@ -371,6 +407,18 @@ static int parse_opts(char *opts, kuid_t *uid, kgid_t *gid, umode_t *umask,
                                 return 0;
                         break;
                 }
+                case Opt_discard:
+                        *discard = 1;
+                        break;
+                case Opt_nodiscard:
+                        *discard = 0;
+                        break;
+                case Opt_bitmaps_cached:
+                        *resident = 0;
+                        break;
+                case Opt_bitmaps_resident:
+                        *resident = 1;
+                        break;
                 default:
                         return 0;
                 }
@@ -401,6 +449,10 @@ NTFS filesystem options:\n\
       eas=ro            read but do not write extended attributes\n\
       eas=rw            r/w eas => enables chmod, chown, mknod, ln -s (default)\n\
       timeshift=nnn     add nnn seconds to file times\n\
+      discard           discard freed sectors on the device, in batches\n\
+      nodiscard         do not discard freed sectors (default)\n\
+      bitmaps=cached    access bitmaps through the buffer cache (default)\n\
+      bitmaps=resident  keep all bitmaps in memory\n\
 \n");
 }
 
@@ -409,22 +461,29 @@ static int ntfs_remount_fs(struct super_block *s, int *flags, char *data)
         kuid_t uid;
         kgid_t gid;
         umode_t umask;
-        int lowercase, eas, chk, errs, chkdsk, timeshift;
+        int lowercase, eas, chk, errs, chkdsk, timeshift, discard, resident;
         int o;
         struct ntfs_sb_info *sbi = ntfs_sb(s);
         char *new_opts = kstrdup(data, GFP_KERNEL);
 
         *flags |= MS_NOATIME;
 
+        /* Queued frees must reach the bitmaps while we can still write */
+        if (*flags & MS_RDONLY) {
+                cancel_delayed_work_sync(&sbi->sb_discard_work);
+                ntfs_flush_discards(s);
+        }
+
         ntfs_lock(s);
         uid = sbi->sb_uid; gid = sbi->sb_gid;
         umask = 0777 & ~sbi->sb_mode;
         lowercase = sbi->sb_lowercase;
         eas = sbi->sb_eas; chk = sbi->sb_chk; chkdsk = sbi->sb_chkdsk;
         errs = sbi->sb_err; timeshift = sbi->sb_timeshift;
+        discard = sbi->sb_discard; resident = sbi->sb_resident;
 
         if (!(o = parse_opts(data, &uid, &gid, &umask, &lowercase,
-            &eas, &chk, &errs, &chkdsk, &timeshift))) {
+            &eas, &chk, &errs, &chkdsk, &timeshift, &discard, &resident))) {
                 printk("NTFS: bad mount options.\n");
                 goto out_err;
         }
@@ -436,6 +495,10 @@ static int ntfs_remount_fs(struct super_block *s, int *flags, char *data)
                 printk("NTFS: timeshift can't be changed using remount.\n");
                 goto out_err;
         }
+        if (discard && !sbi->sb_discard && !blk_queue_discard(bdev_get_queue(s->s_bdev))) {
+                printk("NTFS: the device doesn't support discard, option ignored\n");
+                discard = 0;
+        }
 
         unmark_dirty(s);
 
@@ -444,12 +507,23 @@ static int ntfs_remount_fs(struct super_block *s, int *flags, char *data)
         sbi->sb_lowercase = lowercase;
         sbi->sb_eas = eas; sbi->sb_chk = chk; sbi->sb_chkdsk = chkdsk;
         sbi->sb_err = errs; sbi->sb_timeshift = timeshift;
+        sbi->sb_discard = discard;
+        sbi->sb_resident = resident;
+        if (!resident) ntfs_free_resident_bitmaps(s);
+        else ntfs_load_resident_bitmaps(s);
 
-        if (!(*flags & MS_RDONLY)) mark_dirty(s, 1);
+        if (!(*flags & MS_RDONLY)) {
+                mark_dirty(s, 1);
+                if (!sbi->sb_free_tree_ok) ntfs_build_free_tree(s);
+        } else ntfs_drop_free_tree(s);
 
         replace_mount_options(s, new_opts);
 
         ntfs_unlock(s);
+        if (!discard) {
+                cancel_delayed_work_sync(&sbi->sb_discard_work);
+                ntfs_flush_discards(s);
+        }
         return 0;
 
 out_err:
@@ -483,7 +557,7 @@ static int ntfs_fill_super(struct super_block *s, void *options, int silent)
         kuid_t uid;
         kgid_t gid;
         umode_t umask;
-        int lowercase, eas, chk, errs, chkdsk, timeshift;
+        int lowercase, eas, chk, errs, chkdsk, timeshift, discard, resident;
 
         dnode_secno root_dno;
         struct ntfs_dirent *de = NULL;
@@ -501,6 +575,13 @@ static int ntfs_fill_super(struct super_block *s, void *options, int silent)
 
         sbi->sb_bmp_dir = NULL;
         sbi->sb_cp_table = NULL;
+        sbi->sb_free_tree = RB_ROOT;
+        sbi->sb_band_free = NULL;
+        sbi->sb_s = s;
+        INIT_LIST_HEAD(&sbi->sb_windows);
+        INIT_LIST_HEAD(&sbi->sb_discard_list);
+        INIT_DELAYED_WORK(&sbi->sb_discard_work, ntfs_discard_work);
+        ntfs_init_readahead(s);
 
         mutex_init(&sbi->ntfs_mutex);
         ntfs_lock(s);
@@ -514,9 +595,11 @@ static int ntfs_fill_super(struct super_block *s, void *options, int silent)
         errs = 1;
         chkdsk = 1;
         timeshift = 0;
+        discard = 0;
+        resident = 0;
 
         if (!(o = parse_opts(options, &uid, &gid, &umask, &lowercase,
-            &eas, &chk, &errs, &chkdsk, &timeshift))) {
+            &eas, &chk, &errs, &chkdsk, &timeshift, &discard, &resident))) {
                 printk("NTFS: bad mount options.\n");
                 goto bail0;
         }
@@ -524,6 +607,10 @@ static int ntfs_fill_super(struct super_block *s, void *options, int silent)
                 ntfs_help();
                 goto bail0;
         }
+        if (discard && !blk_queue_discard(bdev_get_queue(s->s_bdev))) {
+                printk("NTFS: the device doesn't support discard, option ignored\n");
+                discard = 0;
+        }
 
         /*sbi->sb_mounting = 1;*/
         sb_set_blocksize(s, 512);
@@ -573,6 +660,8 @@ static int ntfs_fill_super(struct super_block *s, void *options, int silent)
         sbi->sb_chkdsk = chkdsk;
         sbi->sb_err = errs;
         sbi->sb_timeshift = timeshift;
+        sbi->sb_discard = discard;
+        sbi->sb_resident = resident;
         sbi->sb_was_error = 0;
         sbi->sb_cp_table = NULL;
         sbi->sb_c_bitmap = -1;
@@ -646,6 +735,14 @@ static int ntfs_fill_super(struct super_block *s, void *options, int silent)
                 if (!(sbi->sb_cp_table = ntfs_load_code_page(s, le32_to_cpu(spareblock->code_page_dir))))
                         printk("NTFS: Warning: code page support is disabled\n");
 
+        /* Free space summary, see count_bitmaps */
+        sbi->sb_band_free = kmalloc(((sbi->sb_fs_size + 0x3fff) >> 14) * sizeof(unsigned), GFP_KERNEL);
+        count_bitmaps(s);
+        if (resident) ntfs_load_resident_bitmaps(s);
+
+        if (!(s->s_flags & MS_RDONLY))
+                ntfs_build_free_tree(s);
+
         brelse(bh2);
         brelse(bh1);
         brelse(bh0);
@@ -685,6 +782,10 @@ static int ntfs_fill_super(struct super_block *s, void *options, int silent)
                 ntfs_brelse4(&qbh);
         }
         ntfs_unlock(s);
+
+        /* Readahead statistics, failure to register them isn't fatal */
+        if (ntfs_proc_root && (sbi->sb_proc = proc_mkdir(s->s_id, ntfs_proc_root)))
+                proc_create_data("readahead", S_IRUGO, sbi->sb_proc, &ntfs_ra_proc_fops, s);
         return 0;
 
 bail4:  brelse(bh2);
@@ -692,9 +793,12 @@ bail3:  brelse(bh1);
 bail2:  brelse(bh0);
 bail1:
 bail0:
+        ntfs_drop_free_tree(s);
+        ntfs_free_resident_bitmaps(s);
         ntfs_unlock(s);
         kfree(sbi->sb_bmp_dir);
         kfree(sbi->sb_cp_table);
+        kfree(sbi->sb_band_free);
         s->s_fs_info = NULL;
         kfree(sbi);
         return -EINVAL;
@@ -720,11 +824,23 @@ static int __init init_ntfs_fs(void)
         int err = init_inodecache();
         if (err)
                 goto out1;
+        err = ntfs_init_buffer_caches();
+        if (err)
+                goto out2;
+        err = ntfs_init_extent_cache();
+        if (err)
+                goto out3;
+        ntfs_proc_root = proc_mkdir("fs/ntfs", NULL);
         err = register_filesystem(&ntfs_fs_type);
         if (err)
                 goto out;
         return 0;
 out:
+        if (ntfs_proc_root) remove_proc_entry("fs/ntfs", NULL);
+        ntfs_destroy_extent_cache();
+out3:
+        ntfs_destroy_buffer_caches();
+out2:
         destroy_inodecache();
 out1:
         return err;
@@ -733,6 +849,9 @@ out1:
 static void __exit exit_ntfs_fs(void)
 {
         unregister_filesystem(&ntfs_fs_type);
+        if (ntfs_proc_root) remove_proc_entry("fs/ntfs", NULL);
+        ntfs_destroy_extent_cache();
+        ntfs_destroy_buffer_caches();
         destroy_inodecache();
 }
 